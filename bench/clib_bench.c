@@ -0,0 +1,432 @@
+// checks and times clib's hot primitives on the host: comm rings, the
+// trees, the heap and slabs, and mem_copy. Built with 'scons bench'; pass
+// a number to scale the iteration counts.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clib/avl.h"
+#include "clib/avl64.h"
+#include "clib/comm.h"
+#include "clib/comm_private.h"
+#include "clib/heap.h"
+#include "clib/mem.h"
+#include "clib/radix.h"
+#include "clib/slab.h"
+
+#include "host_heap.h"
+
+// as in the scheduler's channels
+#define RING_SIZE 0x800
+#define TREE_SIZE 100000
+
+static uint64_t scale = 1;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *what, double start, uint64_t ops) {
+    printf("%-40s %10.1f ns/op\n", what, (now() - start) * 1e9 / ops);
+}
+
+// keeps the compiler from dropping otherwise unused results
+static void sink(void *p) {
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+static int failures;
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            printf("check failed: %s (%s:%d)\n", #cond, __FILE__, __LINE__); \
+            failures ++; \
+        } \
+    } while(0)
+
+typedef struct {
+    avl64_node_t node;
+    uint64_t value;
+} item_t;
+
+static uint64_t keys[TREE_SIZE];
+static item_t items[TREE_SIZE];
+
+static void shuffle(uint64_t *v, uint64_t count) {
+    for(uint64_t i = count - 1; i > 0; i --) {
+        uint64_t j = rng() % (i + 1), t = v[i];
+        v[i] = v[j], v[j] = t;
+    }
+}
+
+static void ignore(void *key, void *data) {
+    (void)key, (void)data;
+}
+
+static void make_keys(void) {
+    // distinct, spread out like physical addresses and IDs
+    for(uint64_t i = 0; i < TREE_SIZE; i ++) keys[i] = (i + 1) * 0x1008;
+    shuffle(keys, TREE_SIZE);
+}
+
+static void check_comm(void) {
+    comm_t *cc = heap_alloc(RING_SIZE);
+    CHECK(comm_init(cc, RING_SIZE, COMM_SIMPLE) == 0);
+
+    // enough traffic to wrap around many times
+    uint8_t in[200], out[200];
+    for(uint64_t i = 0; i < 1000; i ++) {
+        uint64_t size = 1 + rng() % sizeof(in);
+        for(uint64_t j = 0; j < size; j ++) in[j] = rng();
+        CHECK(comm_put(cc, in, size) == 0);
+
+        uint64_t out_size = sizeof(out);
+        CHECK(comm_peek(cc, out, &out_size) == 0);
+        CHECK(out_size == size && !memcmp(in, out, size));
+    }
+
+    uint64_t out_size = sizeof(out);
+    CHECK(comm_peek(cc, out, &out_size) == 1);
+    heap_free(cc);
+}
+
+static void check_trees(void) {
+    avl64_tree_t tree;
+    avl64_initialize(&tree);
+    avl_tree_t old;
+    avl_initialize(&old, avl_ptrcmp, 0);
+
+    for(uint64_t i = 0; i < TREE_SIZE; i ++) {
+        items[i].node.key = keys[i];
+        CHECK(avl64_insert(&tree, &items[i].node) == 0);
+        avl_insert(&old, (void *)keys[i], items + i);
+    }
+    CHECK(avl64_insert(&tree, &items[0].node) == &items[0].node);
+
+    // in order, and agreeing with the old tree
+    uint64_t count = 0, prev = 0;
+    avl64_node_t *node = avl64_first(&tree);
+    for(; node; node = avl64_next(node), count ++) {
+        CHECK(node->key > prev);
+        CHECK(avl_search(&old, (void *)node->key) ==
+            AVL64_ENTRY(node, item_t, node));
+        prev = node->key;
+    }
+    CHECK(count == TREE_SIZE);
+
+    for(uint64_t i = 0; i < TREE_SIZE; i += 2) {
+        avl64_remove(&tree, &items[i].node);
+        avl_remove(&old, (void *)keys[i]);
+    }
+    for(uint64_t i = 0; i < TREE_SIZE; i ++) {
+        void *expected = (i & 1) ? &items[i].node : 0;
+        CHECK((void *)avl64_search(&tree, keys[i]) == expected);
+        CHECK(!!avl_search(&old, (void *)keys[i]) == (i & 1));
+
+        // keys are multiples of 0x1008, so one past a key finds the next
+        avl64_node_t *lb = avl64_lower_bound(&tree, keys[i] + 1);
+        CHECK(!lb || lb->key > keys[i]);
+    }
+
+    for(uint64_t i = 1; i < TREE_SIZE; i += 2) {
+        avl64_remove(&tree, &items[i].node);
+    }
+    CHECK(tree.root == 0);
+    avl_destroy(&old, ignore);
+}
+
+static void check_radix(void) {
+    radix_tree_t tree;
+    radix_init(&tree);
+
+    for(uint64_t i = 0; i < TREE_SIZE; i ++) {
+        CHECK(radix_set(&tree, keys[i] >> 3, items + i) == 0);
+    }
+    for(uint64_t i = 0; i < TREE_SIZE; i ++) {
+        CHECK(radix_get(&tree, keys[i] >> 3) == items + i);
+        CHECK(radix_get(&tree, (keys[i] >> 3) + 1) == 0);
+    }
+    CHECK(radix_set(&tree, RADIX_MAX_KEY + 1, items) == -1);
+
+    for(uint64_t i = 0; i < TREE_SIZE; i ++) {
+        CHECK(radix_set(&tree, keys[i] >> 3, 0) == 0);
+    }
+    CHECK(tree.root == 0 && tree.nodes == 0);
+}
+
+static void check_heap(void) {
+    enum { COUNT = 4096 };
+    static uint8_t *blocks[COUNT];
+    static uint64_t sizes[COUNT];
+
+    for(uint64_t round = 0; round < 8; round ++) {
+        for(uint64_t i = 0; i < COUNT; i ++) {
+            sizes[i] = 1 + rng() % ((rng() & 15) ? 256 : 65536);
+            blocks[i] = heap_alloc(sizes[i]);
+            CHECK(blocks[i] != 0);
+            CHECK(((uint64_t)blocks[i] & 15) == 0);
+            mem_set(blocks[i], i, sizes[i]);
+        }
+        for(uint64_t i = 0; i < COUNT; i ++) {
+            for(uint64_t j = 0; j < sizes[i]; j ++) {
+                if(blocks[i][j] != (uint8_t)i) {
+                    CHECK(blocks[i][j] == (uint8_t)i);
+                    break;
+                }
+            }
+            heap_free(blocks[i]);
+        }
+    }
+
+    // trimming hands most of it back
+    uint8_t *big = heap_alloc(64 << 20);
+    CHECK(big != 0);
+    uint64_t grown = host_heap_size();
+    heap_free(big);
+    CHECK(host_heap_size() < grown);
+}
+
+static void bench_comm(void) {
+    comm_t *cc = heap_alloc(RING_SIZE);
+    comm_init(cc, RING_SIZE, COMM_SIMPLE);
+
+    static const uint64_t sizes[] = { 8, 64, 256, 1024 };
+    uint8_t data[1024] = { 0 };
+    for(uint64_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s ++) {
+        uint64_t ops = 1000000 * scale;
+        double start = now();
+        for(uint64_t i = 0; i < ops; i ++) {
+            uint64_t size = sizeof(data);
+            comm_put(cc, data, sizes[s]);
+            comm_peek(cc, data, &size);
+        }
+
+        char what[64];
+        snprintf(what, sizeof(what), "comm put+peek %lu bytes",
+            (unsigned long)sizes[s]);
+        report(what, start, ops);
+    }
+
+    heap_free(cc);
+}
+
+static void bench_trees(void) {
+    uint64_t count = TREE_SIZE;
+    double start;
+
+    avl_tree_t old;
+    avl_initialize(&old, avl_ptrcmp, 0);
+    start = now();
+    for(uint64_t i = 0; i < count; i ++) {
+        avl_insert(&old, (void *)keys[i], items + i);
+    }
+    report("avl insert (100k keys)", start, count);
+
+    start = now();
+    for(uint64_t r = 0; r < scale; r ++) {
+        for(uint64_t i = 0; i < count; i ++) {
+            sink(avl_search(&old, (void *)keys[i]));
+        }
+    }
+    report("avl search hit", start, count * scale);
+
+    start = now();
+    for(uint64_t i = 0; i < count; i ++) avl_remove(&old, (void *)keys[i]);
+    report("avl remove", start, count);
+
+    avl64_tree_t tree;
+    avl64_initialize(&tree);
+    start = now();
+    for(uint64_t i = 0; i < count; i ++) {
+        items[i].node.key = keys[i];
+        avl64_insert(&tree, &items[i].node);
+    }
+    report("avl64 insert (100k keys)", start, count);
+
+    start = now();
+    for(uint64_t r = 0; r < scale; r ++) {
+        for(uint64_t i = 0; i < count; i ++) {
+            sink(avl64_search(&tree, keys[i]));
+        }
+    }
+    report("avl64 search hit", start, count * scale);
+
+    start = now();
+    for(uint64_t r = 0; r < scale; r ++) {
+        for(uint64_t i = 0; i < count; i ++) {
+            sink(avl64_lower_bound(&tree, keys[i] + 1));
+        }
+    }
+    report("avl64 lower_bound", start, count * scale);
+
+    start = now();
+    uint64_t visited = 0;
+    for(uint64_t r = 0; r < scale; r ++) {
+        avl64_node_t *node = avl64_first(&tree);
+        for(; node; node = avl64_next(node)) visited ++;
+    }
+    report("avl64 in-order step", start, visited);
+
+    start = now();
+    for(uint64_t i = 0; i < count; i ++) avl64_remove(&tree, &items[i].node);
+    report("avl64 remove", start, count);
+
+    radix_tree_t radix;
+    radix_init(&radix);
+    start = now();
+    for(uint64_t i = 0; i < count; i ++) {
+        radix_set(&radix, keys[i] >> 3, items + i);
+    }
+    report("radix set (100k keys)", start, count);
+
+    start = now();
+    for(uint64_t r = 0; r < scale; r ++) {
+        for(uint64_t i = 0; i < count; i ++) {
+            sink(radix_get(&radix, keys[i] >> 3));
+        }
+    }
+    report("radix get hit", start, count * scale);
+
+    // pages far from any key, as for most page frees
+    start = now();
+    for(uint64_t r = 0; r < scale; r ++) {
+        for(uint64_t i = 0; i < count; i ++) {
+            sink(radix_get(&radix, (keys[i] << 20) & RADIX_MAX_KEY));
+        }
+    }
+    report("radix get miss", start, count * scale);
+
+    start = now();
+    for(uint64_t i = 0; i < count; i ++) radix_set(&radix, keys[i] >> 3, 0);
+    report("radix clear", start, count);
+}
+
+static void *thread_cache;
+static void *cache_get(void) {
+    return thread_cache;
+}
+static void cache_set(void *cache) {
+    thread_cache = cache;
+}
+
+static void bench_heap_patterns(const char *label) {
+    enum { BATCH = 1024 };
+    static void *blocks[BATCH];
+    static const uint64_t sizes[] = { 16, 64, 256, 4096 };
+    char what[64];
+
+    for(uint64_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s ++) {
+        uint64_t ops = 1000000 * scale;
+        double start = now();
+        for(uint64_t i = 0; i < ops; i ++) {
+            void *p = heap_alloc(sizes[s]);
+            sink(p);
+            heap_free(p);
+        }
+        snprintf(what, sizeof(what), "%s alloc+free %lu bytes", label,
+            (unsigned long)sizes[s]);
+        report(what, start, ops);
+    }
+
+    // a batch of mixed small sizes, freed in allocation order
+    uint64_t rounds = 1000 * scale;
+    double start = now();
+    for(uint64_t r = 0; r < rounds; r ++) {
+        for(uint64_t i = 0; i < BATCH; i ++) {
+            blocks[i] = heap_alloc(8 + (i * 40) % 248);
+        }
+        for(uint64_t i = 0; i < BATCH; i ++) heap_free(blocks[i]);
+    }
+    snprintf(what, sizeof(what), "%s mixed batch, fifo free", label);
+    report(what, start, rounds * BATCH);
+
+    // a heap crossing the trim threshold back and forth
+    rounds = 1000 * scale;
+    start = now();
+    for(uint64_t r = 0; r < rounds; r ++) {
+        void *p = heap_alloc(1 << 20);
+        sink(p);
+        heap_free(p);
+    }
+    snprintf(what, sizeof(what), "%s alloc+free 1MB", label);
+    report(what, start, rounds);
+}
+
+static void bench_heap(void) {
+    bench_heap_patterns("heap");
+
+    heap_set_thread_cache(cache_get, cache_set);
+    bench_heap_patterns("cached heap");
+    heap_thread_exit();
+    heap_set_thread_cache(0, 0);
+
+    slab_cache_t cache = SLAB_CACHE_INIT("bench", 48, 0);
+    uint64_t ops = 1000000 * scale;
+    double start = now();
+    for(uint64_t i = 0; i < ops; i ++) {
+        void *p = slab_alloc(&cache);
+        sink(p);
+        slab_free(&cache, p);
+    }
+    report("slab alloc+free 48 bytes", start, ops);
+}
+
+static void bench_mem(void) {
+    static const uint64_t sizes[] = { 8, 16, 32, 64, 128, 256, 1024, 4096 };
+    uint8_t *src = heap_alloc(4096 + 64), *dest = heap_alloc(4096 + 64);
+    mem_set(src, 0x5a, 4096 + 64);
+
+    for(uint64_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s ++) {
+        uint64_t ops = 10000000 * scale / (1 + sizes[s] / 64);
+        double start = now();
+        for(uint64_t i = 0; i < ops; i ++) {
+            mem_copy(dest + (i & 7), src, sizes[s]);
+            sink(dest);
+        }
+
+        char what[64];
+        snprintf(what, sizeof(what), "mem_copy %lu bytes",
+            (unsigned long)sizes[s]);
+        report(what, start, ops);
+    }
+
+    heap_free(src), heap_free(dest);
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1) scale = strtoull(argv[1], 0, 0);
+    if(scale == 0) scale = 1;
+
+    if(host_heap_init()) {
+        printf("couldn't reserve the heap\n");
+        return 1;
+    }
+
+    make_keys();
+    check_comm();
+    check_trees();
+    check_radix();
+    check_heap();
+    if(failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    bench_comm();
+    bench_trees();
+    bench_heap();
+    bench_mem();
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "clib/heap.h"
+
+#include "host_heap.h"
+
+// address space reserved up front; only what the heap grows into is used
+#define HOST_HEAP_RESERVE (4ULL << 30)
+
+static int64_t heap_size;
+
+static void *host_heap_sizer(void __attribute__((unused)) *context,
+    int64_t by) {
+
+    uint64_t prev_end = (uint64_t)heap_get_start() + heap_size;
+
+    if(by < 0) {
+        // dlmalloc only gives back whole pages off the top
+        uint64_t shrink = (-by) & ~0xfffULL;
+        if(shrink > (uint64_t)heap_size) return (void *)-1;
+        if(shrink == 0) return (void *)prev_end;
+
+        madvise((void *)(prev_end - shrink), shrink, MADV_DONTNEED);
+        heap_size -= shrink;
+    }
+    else {
+        by = (by+0xfff) & ~0xfff;
+        if((uint64_t)(heap_size + by) > HOST_HEAP_RESERVE) return (void *)-1;
+        heap_size += by;
+    }
+
+    return (void *)prev_end;
+}
+
+int host_heap_init(void) {
+    void *start = mmap(0, HOST_HEAP_RESERVE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(start == MAP_FAILED) return 1;
+
+    heap_init(start);
+    heap_set_sizer(host_heap_sizer, 0);
+    return 0;
+}
+
+uint64_t host_heap_size(void) {
+    return heap_size;
+}
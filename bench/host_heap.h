@@ -0,0 +1,12 @@
+#ifndef BENCH_HOST_HEAP_H
+#define BENCH_HOST_HEAP_H
+
+#include <stdint.h>
+
+// points clib's heap at a region reserved with mmap, grown and trimmed the
+// way the kernel and rlib sizers do it
+int host_heap_init(void);
+// bytes currently handed to the heap
+uint64_t host_heap_size(void);
+
+#endif
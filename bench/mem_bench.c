@@ -0,0 +1,144 @@
+// times clib's mem_copy, mem_move and mem_set against plain byte loops
+// across sizes and alignments. Built for the host with 'scons bench'.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clib/mem.h"
+
+#define BUFFER_SIZE (1 << 20)
+// bytes moved per measurement, so that small sizes get enough iterations
+#define BYTES_PER_RUN (64ULL << 20)
+
+static const uint64_t sizes[] = {
+    1, 7, 8, 15, 16, 31, 32, 63, 64, 127, 128, 255, 256, 511, 512, 1024,
+    4096, 16384, 65536, 262144
+};
+static const uint64_t alignments[][2] = {
+    {0, 0}, {1, 0}, {0, 3}, {5, 7}
+};
+
+static void *byte_copy(void *dest, const void *src, uint64_t count) {
+    volatile uint8_t *d8 = dest;
+    const uint8_t *s8 = src;
+    while(count--) *d8++ = *s8++;
+    return dest;
+}
+
+static void *byte_move(void *dest, const void *src, uint64_t count) {
+    volatile uint8_t *d8 = dest;
+    const uint8_t *s8 = src;
+    if(d8 < s8) while(count--) *d8++ = *s8++;
+    else while(count--) d8[count] = s8[count];
+    return dest;
+}
+
+static void *byte_set(void *memory, uint8_t v, uint64_t count) {
+    volatile uint8_t *m8 = memory;
+    while(count--) *m8++ = v;
+    return memory;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef void *(*copy_fn_t)(void *, const void *, uint64_t);
+
+// returns throughput in MB/s
+static double time_copy(copy_fn_t fn, uint8_t *dest, const uint8_t *src,
+    uint64_t size) {
+
+    uint64_t iterations = BYTES_PER_RUN / size;
+    if(iterations < 16) iterations = 16;
+
+    double start = now();
+    for(uint64_t i = 0; i < iterations; i ++) {
+        fn(dest, src, size);
+        __asm__ __volatile__("" : : "r"(dest) : "memory");
+    }
+    return size * iterations / (now() - start) / 1e6;
+}
+
+static double time_set(void *(*fn)(void *, uint8_t, uint64_t), uint8_t *dest,
+    uint64_t size) {
+
+    uint64_t iterations = BYTES_PER_RUN / size;
+    if(iterations < 16) iterations = 16;
+
+    double start = now();
+    for(uint64_t i = 0; i < iterations; i ++) {
+        fn(dest, i, size);
+        __asm__ __volatile__("" : : "r"(dest) : "memory");
+    }
+    return size * iterations / (now() - start) / 1e6;
+}
+
+static int check(void) {
+    uint8_t *a = malloc(4096), *b = malloc(4096), *c = malloc(4096);
+    int bad = 0;
+    for(uint64_t s = 0; s < 600; s ++) {
+        for(uint64_t da = 0; da < 8; da ++) for(uint64_t sa = 0; sa < 8; sa ++) {
+            for(int i = 0; i < 4096; i ++) a[i] = rand(), b[i] = c[i] = rand();
+            mem_copy(b + da, a + sa, s);
+            memcpy(c + da, a + sa, s);
+            if(memcmp(b, c, 4096)) bad ++;
+
+            // overlapping moves, both directions
+            memcpy(b, a, 4096), memcpy(c, a, 4096);
+            mem_move(b + 100 + da, b + 100 + sa * 3, s);
+            memmove(c + 100 + da, c + 100 + sa * 3, s);
+            if(memcmp(b, c, 4096)) bad ++;
+
+            mem_set(b + da, sa, s);
+            memset(c + da, sa, s);
+            if(memcmp(b + da, c + da, s)) bad ++;
+        }
+    }
+    free(a), free(b), free(c);
+    return bad;
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1 && !strcmp(argv[1], "--vector")) mem_use_vector(1);
+
+    int bad = check();
+    if(bad) {
+        printf("%d mismatches against libc!\n", bad);
+        return 1;
+    }
+
+    uint8_t *src = malloc(BUFFER_SIZE + 64), *dest = malloc(BUFFER_SIZE + 64);
+    memset(src, 0x5a, BUFFER_SIZE + 64);
+
+    printf("%8s %6s %10s %10s %10s %10s %10s %10s\n", "size", "align",
+        "byte copy", "mem_copy", "byte move", "mem_move", "byte set",
+        "mem_set");
+    for(uint64_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i ++) {
+        for(uint64_t a = 0; a < sizeof(alignments) / sizeof(*alignments); a ++) {
+            uint8_t *d = dest + alignments[a][0];
+            uint8_t *s = src + alignments[a][1];
+            uint64_t size = sizes[i];
+
+            printf("%8lu %3lu/%-2lu %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+                (unsigned long)size, (unsigned long)alignments[a][0],
+                (unsigned long)alignments[a][1],
+                time_copy(byte_copy, d, s, size),
+                time_copy(mem_copy, d, s, size),
+                // overlapping, so mem_move can't fall back to mem_copy
+                time_copy(byte_move, d + 1, d, size),
+                time_copy(mem_move, d + 1, d, size),
+                time_set(byte_set, d, size),
+                time_set(mem_set, d, size));
+        }
+    }
+    printf("(MB/s)\n");
+
+    free(src), free(dest);
+    return 0;
+}
@@ -14,6 +14,10 @@
     #define NULL ((void *)0)
 #endif
 
+/* nodes of every tree come from one cache */
+slab_cache_t AVL_NAME(node_cache) = SLAB_CACHE_INIT("avl node",
+    sizeof(AVL_NAME(tree_node_t)), NULL);
+
 /* recursive window-search helper */
 static void AVL_NAME(search_window_helper)(AVL_NAME(tree_t) *tree,
     AVL_NAME(tree_node_t) *node, AVL_NAME(node_visitor_t) visitor, void *key1,
@@ -10,13 +10,14 @@
 #ifndef AVL_H
 #define AVL_H
 
-#include "heap.h"
+#include "slab.h"
 
 /* modify this macro to change the prefix */
 #define AVL_NAME(name) avl_ ## name
 /* memory allocation macros, change as necessary */
-#define AVL_ALLOC(variable, type) variable = (type *)heap_alloc(sizeof(type))
-#define AVL_FREE(variable) heap_free(variable)
+#define AVL_ALLOC(variable, type) \
+    variable = (type *)slab_alloc(&AVL_NAME(node_cache))
+#define AVL_FREE(variable) slab_free(&AVL_NAME(node_cache), variable)
 
 typedef int (*AVL_NAME(comparator_t))(void *key1, void *key2);
 typedef void (*AVL_NAME(key_destructor_t))(void *key);
@@ -30,6 +31,8 @@ typedef struct AVL_NAME(tree_node_t) {
     void *data;
 } AVL_NAME(tree_node_t);
 
+extern slab_cache_t AVL_NAME(node_cache);
+
 typedef struct {
     AVL_NAME(tree_node_t) *root;
     AVL_NAME(comparator_t) comparator;
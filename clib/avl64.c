@@ -0,0 +1,189 @@
+/*
+    Intrusive AVL tree with uint64_t keys, source file.
+*/
+
+#include "avl64.h"
+
+#ifndef NULL
+    #define NULL ((void *)0)
+#endif
+
+typedef AVL64_NAME(node_t) node_t;
+typedef AVL64_NAME(tree_t) tree_t;
+
+static int AVL64_NAME(depth)(node_t *node) {
+    return node ? node->depth : 0;
+}
+
+static void AVL64_NAME(update)(node_t *node) {
+    int l = AVL64_NAME(depth)(node->left);
+    int r = AVL64_NAME(depth)(node->right);
+    node->depth = (l > r ? l : r) + 1;
+}
+
+/* puts child where old was under parent, or at the root */
+static void AVL64_NAME(replace)(tree_t *tree, node_t *parent, node_t *old,
+    node_t *child) {
+
+    if(parent == NULL) tree->root = child;
+    else if(parent->left == old) parent->left = child;
+    else parent->right = child;
+
+    if(child) child->parent = parent;
+}
+
+static node_t *AVL64_NAME(rotate_left)(tree_t *tree, node_t *node) {
+    node_t *top = node->right;
+
+    node->right = top->left;
+    if(top->left) top->left->parent = node;
+    AVL64_NAME(replace)(tree, node->parent, node, top);
+    top->left = node;
+    node->parent = top;
+
+    AVL64_NAME(update)(node);
+    AVL64_NAME(update)(top);
+    return top;
+}
+
+static node_t *AVL64_NAME(rotate_right)(tree_t *tree, node_t *node) {
+    node_t *top = node->left;
+
+    node->left = top->right;
+    if(top->right) top->right->parent = node;
+    AVL64_NAME(replace)(tree, node->parent, node, top);
+    top->right = node;
+    node->parent = top;
+
+    AVL64_NAME(update)(node);
+    AVL64_NAME(update)(top);
+    return top;
+}
+
+/* restores the balance of the subtree at node; returns its new top */
+static node_t *AVL64_NAME(rebalance)(tree_t *tree, node_t *node) {
+    AVL64_NAME(update)(node);
+
+    int balance = AVL64_NAME(depth)(node->left)
+        - AVL64_NAME(depth)(node->right);
+    if(balance > 1) {
+        node_t *l = node->left;
+        if(AVL64_NAME(depth)(l->left) < AVL64_NAME(depth)(l->right)) {
+            AVL64_NAME(rotate_left)(tree, l);
+        }
+        return AVL64_NAME(rotate_right)(tree, node);
+    }
+    else if(balance < -1) {
+        node_t *r = node->right;
+        if(AVL64_NAME(depth)(r->right) < AVL64_NAME(depth)(r->left)) {
+            AVL64_NAME(rotate_right)(tree, r);
+        }
+        return AVL64_NAME(rotate_left)(tree, node);
+    }
+
+    return node;
+}
+
+/* rebalances from node towards the root, stopping once a subtree comes out
+   with the same top and depth it had before */
+static void AVL64_NAME(retrace)(tree_t *tree, node_t *node) {
+    while(node) {
+        int depth = node->depth;
+        node_t *top = AVL64_NAME(rebalance)(tree, node);
+        if(top == node && node->depth == depth) break;
+
+        node = top->parent;
+    }
+}
+
+void AVL64_NAME(initialize)(tree_t *tree) {
+    tree->root = NULL;
+}
+
+node_t *AVL64_NAME(search)(tree_t *tree, uint64_t key) {
+    node_t *node = tree->root;
+    while(node && node->key != key) {
+        node = key < node->key ? node->left : node->right;
+    }
+    return node;
+}
+
+node_t *AVL64_NAME(lower_bound)(tree_t *tree, uint64_t key) {
+    node_t *node = tree->root, *best = NULL;
+    while(node) {
+        if(node->key >= key) {
+            best = node;
+            node = node->left;
+        }
+        else node = node->right;
+    }
+    return best;
+}
+
+node_t *AVL64_NAME(insert)(tree_t *tree, node_t *node) {
+    node_t *parent = NULL;
+    node_t **link = &tree->root;
+    while(*link) {
+        parent = *link;
+        if(node->key == parent->key) return parent;
+        link = node->key < parent->key ? &parent->left : &parent->right;
+    }
+
+    node->left = node->right = NULL;
+    node->parent = parent;
+    node->depth = 1;
+    *link = node;
+
+    AVL64_NAME(retrace)(tree, parent);
+    return NULL;
+}
+
+void AVL64_NAME(remove)(tree_t *tree, node_t *node) {
+    node_t *fix;
+
+    if(node->left && node->right) {
+        /* the in-order successor takes node's place */
+        node_t *next = node->right;
+        while(next->left) next = next->left;
+
+        if(next->parent == node) fix = next;
+        else {
+            fix = next->parent;
+            fix->left = next->right;
+            if(next->right) next->right->parent = fix;
+            next->right = node->right;
+            node->right->parent = next;
+        }
+
+        next->left = node->left;
+        node->left->parent = next;
+        next->depth = node->depth;
+        AVL64_NAME(replace)(tree, node->parent, node, next);
+    }
+    else {
+        fix = node->parent;
+        AVL64_NAME(replace)(tree, node->parent, node,
+            node->left ? node->left : node->right);
+    }
+
+    AVL64_NAME(retrace)(tree, fix);
+}
+
+node_t *AVL64_NAME(first)(tree_t *tree) {
+    node_t *node = tree->root;
+    if(node == NULL) return NULL;
+
+    while(node->left) node = node->left;
+    return node;
+}
+
+node_t *AVL64_NAME(next)(node_t *node) {
+    if(node->right) {
+        node = node->right;
+        while(node->left) node = node->left;
+        return node;
+    }
+
+    while(node->parent && node == node->parent->right) node = node->parent;
+    return node->parent;
+}
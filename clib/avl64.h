@@ -0,0 +1,49 @@
+/*
+    Intrusive AVL tree with uint64_t keys, header file.
+
+    Nodes are embedded in the objects they index, so the tree never
+    allocates; every operation is iterative.
+*/
+
+#ifndef AVL64_H
+#define AVL64_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* modify this macro to change the prefix */
+#define AVL64_NAME(name) avl64_ ## name
+
+/* the object holding node, given the member node is embedded as */
+#define AVL64_ENTRY(node, type, member) \
+    ((type *)((uint8_t *)(node) - offsetof(type, member)))
+
+typedef struct AVL64_NAME(node_t) {
+    struct AVL64_NAME(node_t) *left, *right, *parent;
+    int depth;
+
+    uint64_t key;
+} AVL64_NAME(node_t);
+
+typedef struct {
+    AVL64_NAME(node_t) *root;
+} AVL64_NAME(tree_t);
+
+void AVL64_NAME(initialize)(AVL64_NAME(tree_t) *tree);
+
+AVL64_NAME(node_t) *AVL64_NAME(search)(AVL64_NAME(tree_t) *tree,
+    uint64_t key);
+/* the node with the smallest key not below key, if any */
+AVL64_NAME(node_t) *AVL64_NAME(lower_bound)(AVL64_NAME(tree_t) *tree,
+    uint64_t key);
+/* node->key must be set; returns the node already holding the key instead
+   of inserting, or NULL */
+AVL64_NAME(node_t) *AVL64_NAME(insert)(AVL64_NAME(tree_t) *tree,
+    AVL64_NAME(node_t) *node);
+void AVL64_NAME(remove)(AVL64_NAME(tree_t) *tree, AVL64_NAME(node_t) *node);
+
+/* in-order iteration */
+AVL64_NAME(node_t) *AVL64_NAME(first)(AVL64_NAME(tree_t) *tree);
+AVL64_NAME(node_t) *AVL64_NAME(next)(AVL64_NAME(node_t) *node);
+
+#endif
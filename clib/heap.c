@@ -1,9 +1,30 @@
 #include "heap.h"
 
+// size classes of the per-thread caches: 16, 32, ... bytes
+#define HEAP_CACHE_CLASSES 16
+#define HEAP_CACHE_MAX 32
+#define HEAP_CACHE_BATCH 16
+
+typedef struct heap_cache_t {
+    // singly-linked through the first qword of each block
+    void *heads[HEAP_CACHE_CLASSES];
+    uint64_t counts[HEAP_CACHE_CLASSES];
+} heap_cache_t;
+
 static heap_sizer_t heap_sizer;
 static void *heap_sizer_context;
 static void *heap_start;
 
+static void (*heap_lock_wait)(void);
+static void *(*heap_cache_get)(void);
+static void (*heap_cache_set)(void *cache);
+
+extern void *dlmalloc(uint64_t);
+extern void dlfree(void *);
+extern uint64_t dlmalloc_usable_size(void *);
+extern void **dlindependent_comalloc(uint64_t, uint64_t *, void **);
+extern uint64_t dlbulk_free(void **, uint64_t);
+
 void heap_init(void *start) {
     heap_start = start;
 }
@@ -13,6 +34,15 @@ void heap_set_sizer(heap_sizer_t sizer, void *context) {
     heap_sizer_context = context;
 }
 
+void heap_set_lock_wait(void (*wait)(void)) {
+    heap_lock_wait = wait;
+}
+
+void heap_set_thread_cache(void *(*get)(void), void (*set)(void *cache)) {
+    heap_cache_get = get;
+    heap_cache_set = set;
+}
+
 void *heap_resize(int64_t by) {
     return heap_sizer(heap_sizer_context, by);
 }
@@ -21,12 +51,124 @@ void *heap_get_start(void) {
     return heap_start;
 }
 
-extern void *dlmalloc(uint64_t);
+int heap_lock(int *lock) {
+    while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            // without preemption, the holder only runs if we step aside
+            if(heap_lock_wait) heap_lock_wait();
+            else __asm__ __volatile__("pause");
+        }
+    }
+    return 0;
+}
+
+int heap_trylock(int *lock) {
+    return !__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
+}
+
+void heap_unlock(int *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// returns the calling thread's cache, creating it on first use, or 0 if
+// thread caches are not in use
+static heap_cache_t *heap_cache(void) {
+    if(!heap_cache_get) return 0;
+
+    heap_cache_t *cache = heap_cache_get();
+    if(cache) return cache;
+
+    cache = dlmalloc(sizeof(*cache));
+    if(!cache) return 0;
+    for(int c = 0; c < HEAP_CACHE_CLASSES; c ++) {
+        cache->heads[c] = 0;
+        cache->counts[c] = 0;
+    }
+    heap_cache_set(cache);
+    return cache;
+}
+
+// takes a batch of blocks of class c from the shared heap, all under one
+// acquisition of its lock
+static void heap_cache_refill(heap_cache_t *cache, uint64_t c) {
+    uint64_t sizes[HEAP_CACHE_BATCH];
+    void *blocks[HEAP_CACHE_BATCH];
+    for(int i = 0; i < HEAP_CACHE_BATCH; i ++) sizes[i] = (c + 1) * 16;
+
+    if(!dlindependent_comalloc(HEAP_CACHE_BATCH, sizes, blocks)) return;
+
+    for(int i = 0; i < HEAP_CACHE_BATCH; i ++) {
+        *(void **)blocks[i] = cache->heads[c];
+        cache->heads[c] = blocks[i];
+    }
+    cache->counts[c] += HEAP_CACHE_BATCH;
+}
+
+// hands up to count blocks of class c back to the shared heap
+static void heap_cache_drain(heap_cache_t *cache, uint64_t c, uint64_t count) {
+    void *blocks[HEAP_CACHE_BATCH];
+    while(count > 0 && cache->heads[c]) {
+        uint64_t n = 0;
+        while(n < HEAP_CACHE_BATCH && n < count && cache->heads[c]) {
+            blocks[n] = cache->heads[c];
+            cache->heads[c] = *(void **)blocks[n];
+            n ++;
+        }
+        cache->counts[c] -= n;
+        count -= n;
+        dlbulk_free(blocks, n);
+    }
+}
+
+void heap_thread_exit(void) {
+    if(!heap_cache_get) return;
+
+    heap_cache_t *cache = heap_cache_get();
+    if(!cache) return;
+
+    for(int c = 0; c < HEAP_CACHE_CLASSES; c ++) {
+        heap_cache_drain(cache, c, cache->counts[c]);
+    }
+    heap_cache_set(0);
+    dlfree(cache);
+}
+
 void *heap_alloc(uint64_t size) {
+    // class whose blocks hold at least size bytes
+    uint64_t c = size ? (size - 1) / 16 : 0;
+    heap_cache_t *cache;
+    if(c < HEAP_CACHE_CLASSES && (cache = heap_cache())) {
+        if(!cache->heads[c]) heap_cache_refill(cache, c);
+
+        void *block = cache->heads[c];
+        if(block) {
+            cache->heads[c] = *(void **)block;
+            cache->counts[c] --;
+            return block;
+        }
+    }
+
     return dlmalloc(size);
 }
 
-extern void dlfree(void *);
 void heap_free(void *ptr) {
+    if(!ptr) return;
+
+    // blocks freed by another thread simply join this thread's cache
+    heap_cache_t *cache = heap_cache();
+    if(cache) {
+        uint64_t c = dlmalloc_usable_size(ptr) / 16 - 1;
+        if(c < HEAP_CACHE_CLASSES) {
+            if(cache->counts[c] == HEAP_CACHE_MAX) {
+                heap_cache_drain(cache, c, HEAP_CACHE_BATCH);
+            }
+
+            *(void **)ptr = cache->heads[c];
+            cache->heads[c] = ptr;
+            cache->counts[c] ++;
+            return;
+        }
+    }
+
     dlfree(ptr);
 }
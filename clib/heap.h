@@ -15,4 +15,15 @@ void *heap_get_start(void);
 void *heap_alloc(uint64_t size);
 void heap_free(void *ptr);
 
+// the shared heap is protected by spinlocks; wait is called while spinning
+void heap_set_lock_wait(void (*wait)(void));
+int heap_lock(int *lock);
+int heap_trylock(int *lock);
+void heap_unlock(int *lock);
+
+// optional per-thread caches of small blocks in front of the shared heap;
+// get and set access the calling thread's cache pointer, initially 0
+void heap_set_thread_cache(void *(*get)(void), void (*set)(void *cache));
+void heap_thread_exit(void);
+
 #endif
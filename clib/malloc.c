@@ -14,12 +14,29 @@
 #define MORECORE heap_resize
 #define NO_MALLOC_STATS 1
 #define MALLOC_FAILURE_ACTION {}
+// tasks sharing a memory space share the heap, so it is locked; see
+// heap_lock() in heap.c
+#define USE_LOCKS 2
+#define LACKS_SCHED_H
+#define MLOCK_T int
+#define INITIAL_LOCK(lk) (*(lk) = 0)
+#define DESTROY_LOCK(lk) (0)
+#define ACQUIRE_LOCK(lk) heap_lock(lk)
+#define RELEASE_LOCK(lk) heap_unlock(lk)
+#define TRY_LOCK(lk) heap_trylock(lk)
+// the heap sizers give pages back when called with a negative size. Grow
+// and trim in 64KB steps, and keep up to 512KB spare at the top, so that a
+// heap hovering around one size doesn't map and unmap on every free
+#define DEFAULT_GRANULARITY ((size_t)64U * (size_t)1024U)
+#define DEFAULT_TRIM_THRESHOLD ((size_t)512U * (size_t)1024U)
 
 #define memset mem_set
 #define memcpy mem_copy
 
 #include "heap.h"
 
+static MLOCK_T malloc_global_mutex = 0;
+
 /*
   This is a version (aka dlmalloc) of malloc/free/realloc written by
   Doug Lea and released to the public domain, as explained at
@@ -1,36 +1,207 @@
 #include "mem.h"
 
+// x86 handles unaligned qword accesses; this keeps the compiler honest
+typedef uint64_t __attribute__((may_alias, aligned(1))) mem_u64_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) mem_u32_t;
+
+// copies of at least this many bytes use rep movsb/stosb when the processor
+// has enhanced rep movsb; with fast short rep movsb, the threshold drops
+#define MEM_ERMS_THRESHOLD 512
+#define MEM_FSRM_THRESHOLD 64
+
+// 0 until mem_features() has run, then MEM_FEATURES_KNOWN and whatever
+// else applies
+#define MEM_FEATURES_KNOWN 0x01
+#define MEM_FEATURE_ERMS 0x02
+#define MEM_FEATURE_FSRM 0x04
+#define MEM_FEATURE_VECTOR 0x08
+static uint64_t features;
+
+static uint64_t mem_features(void) {
+    if(features) return features;
+
+    uint64_t found = MEM_FEATURES_KNOWN;
+    uint32_t eax = 0, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if(eax >= 7) {
+        eax = 7, ecx = 0;
+        __asm__ __volatile__("cpuid"
+            : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        if(ebx & (1<<9)) found |= MEM_FEATURE_ERMS;
+        if(edx & (1<<4)) found |= MEM_FEATURE_FSRM;
+    }
+
+    features = found;
+    return features;
+}
+
+void mem_use_vector(int enable) {
+    mem_features();
+    if(enable) features |= MEM_FEATURE_VECTOR;
+    else features &= ~MEM_FEATURE_VECTOR;
+}
+
+static int mem_use_rep(uint64_t count) {
+    uint64_t f = mem_features();
+    if(f & MEM_FEATURE_FSRM) return count >= MEM_FSRM_THRESHOLD;
+    if(f & MEM_FEATURE_ERMS) return count >= MEM_ERMS_THRESHOLD;
+    return 0;
+}
+
 void *mem_set(void *memory, uint8_t v, uint64_t count) {
     uint8_t *m8 = memory;
-    while(count > 0) {
-        *m8 = v;
-        m8 ++;
-        count --;
+
+    if(count < 4) {
+        while(count--) *m8++ = v;
+        return memory;
+    }
+    if(count < 8) {
+        *(mem_u32_t *)m8 = v * 0x01010101U;
+        *(mem_u32_t *)(m8 + count - 4) = v * 0x01010101U;
+        return memory;
     }
+
+    uint64_t word = v * 0x0101010101010101ULL;
+    if(count <= 16) {
+        *(mem_u64_t *)m8 = word;
+        *(mem_u64_t *)(m8 + count - 8) = word;
+        return memory;
+    }
+
+    if(mem_use_rep(count)) {
+        __asm__ __volatile__("rep stosb"
+            : "+D"(m8), "+c"(count) : "a"(v) : "memory");
+        return memory;
+    }
+
+    // one unaligned head word, then aligned words, then an unaligned tail
+    // word that may overlap what is already written
+    uint8_t *end = m8 + count;
+    *(mem_u64_t *)m8 = word;
+    m8 = (uint8_t *)(((uint64_t)m8 + 8) & ~7ULL);
+    while(m8 + 8 <= end) {
+        *(uint64_t *)m8 = word;
+        m8 += 8;
+    }
+    *(mem_u64_t *)(end - 8) = word;
+
     return memory;
 }
 
+// built with -mno-sse, the compiler keeps nothing in vector registers and
+// won't accept them as clobbers
+#ifdef __SSE__
+#define MEM_XMM_CLOBBER "xmm0",
+#else
+#define MEM_XMM_CLOBBER
+#endif
+
+// forward copy with 16-byte SSE moves; count must be at least 16. Only used
+// once a task has said its vector state is free to clobber.
+static void mem_copy_vector(uint8_t *d8, const uint8_t *s8, uint64_t count) {
+    const uint8_t *tail = s8 + count - 16;
+    uint8_t *dtail = d8 + count - 16;
+    while(count >= 16) {
+        __asm__ __volatile__(
+            "movdqu (%1), %%xmm0 \n"
+            "movdqu %%xmm0, (%0)"
+            : : "r"(d8), "r"(s8) : MEM_XMM_CLOBBER "memory");
+        d8 += 16, s8 += 16, count -= 16;
+    }
+    if(count) {
+        __asm__ __volatile__(
+            "movdqu (%1), %%xmm0 \n"
+            "movdqu %%xmm0, (%0)"
+            : : "r"(dtail), "r"(tail) : MEM_XMM_CLOBBER "memory");
+    }
+}
+
 void *mem_copy(void *dest, const void *src, uint64_t count) {
-    return mem_move(dest, src, count);
+    uint8_t *d8 = dest;
+    const uint8_t *s8 = src;
+
+    // small sizes: load everything before storing anything
+    if(count < 4) {
+        while(count--) *d8++ = *s8++;
+        return dest;
+    }
+    if(count < 8) {
+        uint32_t a = *(const mem_u32_t *)s8;
+        uint32_t b = *(const mem_u32_t *)(s8 + count - 4);
+        *(mem_u32_t *)d8 = a;
+        *(mem_u32_t *)(d8 + count - 4) = b;
+        return dest;
+    }
+    if(count <= 16) {
+        uint64_t a = *(const mem_u64_t *)s8;
+        uint64_t b = *(const mem_u64_t *)(s8 + count - 8);
+        *(mem_u64_t *)d8 = a;
+        *(mem_u64_t *)(d8 + count - 8) = b;
+        return dest;
+    }
+    if(count <= 32) {
+        uint64_t a = *(const mem_u64_t *)s8;
+        uint64_t b = *(const mem_u64_t *)(s8 + 8);
+        uint64_t c = *(const mem_u64_t *)(s8 + count - 16);
+        uint64_t e = *(const mem_u64_t *)(s8 + count - 8);
+        *(mem_u64_t *)d8 = a;
+        *(mem_u64_t *)(d8 + 8) = b;
+        *(mem_u64_t *)(d8 + count - 16) = c;
+        *(mem_u64_t *)(d8 + count - 8) = e;
+        return dest;
+    }
+
+    if(mem_use_rep(count)) {
+        __asm__ __volatile__("rep movsb"
+            : "+D"(d8), "+S"(s8), "+c"(count) : : "memory");
+        return dest;
+    }
+
+    if(features & MEM_FEATURE_VECTOR) {
+        mem_copy_vector(d8, s8, count);
+        return dest;
+    }
+
+    // align the destination, then whole words, then an overlapping tail
+    uint64_t tail = *(const mem_u64_t *)(s8 + count - 8);
+    uint8_t *dend = d8 + count;
+    uint64_t head = 8 - ((uint64_t)d8 & 7);
+    *(mem_u64_t *)d8 = *(const mem_u64_t *)s8;
+    d8 += head, s8 += head, count -= head;
+    while(count >= 8) {
+        *(uint64_t *)d8 = *(const mem_u64_t *)s8;
+        d8 += 8, s8 += 8, count -= 8;
+    }
+    *(mem_u64_t *)(dend - 8) = tail;
+
+    return dest;
 }
 
 void *mem_move(void *dest, const void *src, uint64_t count) {
-    if(dest < src) {
-        const uint8_t *s8 = src;
-        uint8_t *d8 = dest;
-        while(count--) {
-            *d8 = *s8;
-            d8 ++, s8 ++;
-        }
+    uint8_t *d8 = dest;
+    const uint8_t *s8 = src;
+
+    // without overlap this is just a copy
+    if(d8 + count <= s8 || s8 + count <= d8) {
+        return mem_copy(dest, src, count);
     }
-    else {
-        const uint8_t *s8 = (uint8_t *)src + count - 1;
-        uint8_t *d8 = (uint8_t *)dest + count - 1;
 
-        while(count--) {
-            *d8 = *s8;
-            d8 --, s8 --;
+    if(d8 < s8) {
+        // forwards: every word is read before the bytes below it are
+        // overwritten
+        while(count >= 8) {
+            *(mem_u64_t *)d8 = *(const mem_u64_t *)s8;
+            d8 += 8, s8 += 8, count -= 8;
+        }
+        while(count--) *d8++ = *s8++;
+    }
+    else if(d8 > s8) {
+        d8 += count, s8 += count;
+        while(count >= 8) {
+            d8 -= 8, s8 -= 8, count -= 8;
+            *(mem_u64_t *)d8 = *(const mem_u64_t *)s8;
         }
+        while(count--) *--d8 = *--s8;
     }
 
     return dest;
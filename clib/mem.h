@@ -3,9 +3,14 @@
 
 #include <stdint.h>
 
-// memory manipulation functions
+// memory manipulation functions; mem_copy's ranges must not overlap
 void *mem_set(void *memory, uint8_t v, uint64_t count);
 void *mem_copy(void *dest, const void *src, uint64_t count);
 void *mem_move(void *dest, const void *src, uint64_t count);
 
+// lets mem_copy use SSE registers. Only for tasks running with CR4.OSFXSR
+// set whose vector registers nobody else relies on; tasks are not
+// preempted, so no state needs saving around a copy.
+void mem_use_vector(int enable);
+
 #endif
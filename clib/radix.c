@@ -0,0 +1,90 @@
+#include "heap.h"
+#include "mem.h"
+#include "radix.h"
+
+static uint64_t radix_index(uint64_t key, int level) {
+    int shift = (RADIX_LEVELS - 1 - level) * RADIX_BITS;
+    return (key >> shift) & (RADIX_SLOTS - 1);
+}
+
+void radix_init(radix_tree_t *tree) {
+    tree->root = 0;
+    tree->nodes = 0;
+}
+
+void *radix_get(radix_tree_t *tree, uint64_t key) {
+    if(key > RADIX_MAX_KEY) return 0;
+
+    radix_node_t *node = tree->root;
+    for(int level = 0; node && level < RADIX_LEVELS - 1; level ++) {
+        node = node->slots[radix_index(key, level)];
+    }
+    if(!node) return 0;
+
+    return node->slots[radix_index(key, RADIX_LEVELS - 1)];
+}
+
+static radix_node_t *radix_node_create(radix_tree_t *tree) {
+    radix_node_t *node = heap_alloc(sizeof(*node));
+    if(!node) return 0;
+
+    mem_set(node, 0, sizeof(*node));
+    tree->nodes ++;
+    return node;
+}
+
+// frees the nodes on path that are left empty, from level up to the root
+static void radix_prune(radix_tree_t *tree, radix_node_t **path, int level,
+    uint64_t key) {
+
+    for(; level >= 0; level --) {
+        if(path[level]->used) break;
+
+        heap_free(path[level]);
+        tree->nodes --;
+
+        if(level == 0) tree->root = 0;
+        else {
+            path[level-1]->slots[radix_index(key, level-1)] = 0;
+            path[level-1]->used --;
+        }
+    }
+}
+
+int radix_set(radix_tree_t *tree, uint64_t key, void *value) {
+    if(key > RADIX_MAX_KEY) return -1;
+
+    // the nodes on the way down, for pruning
+    radix_node_t *path[RADIX_LEVELS];
+
+    void **slot = (void **)&tree->root;
+    for(int level = 0; level < RADIX_LEVELS; level ++) {
+        radix_node_t *node = *slot;
+        if(!node) {
+            // nothing to remove
+            if(!value) return 0;
+
+            node = radix_node_create(tree);
+            if(!node) {
+                // don't leave the nodes made so far behind
+                if(level > 0) radix_prune(tree, path, level - 1, key);
+                return 1;
+            }
+
+            // the parent gains a child
+            if(level > 0) path[level-1]->used ++;
+            *slot = node;
+        }
+
+        path[level] = node;
+        slot = &node->slots[radix_index(key, level)];
+    }
+
+    radix_node_t *leaf = path[RADIX_LEVELS - 1];
+    if(!*slot && value) leaf->used ++;
+    else if(*slot && !value) leaf->used --;
+    *slot = value;
+
+    if(!value) radix_prune(tree, path, RADIX_LEVELS - 1, key);
+    return 0;
+}
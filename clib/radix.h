@@ -0,0 +1,34 @@
+#ifndef CLIB_RADIX_H
+#define CLIB_RADIX_H
+
+#include <stdint.h>
+
+// sparse map from page frame numbers to pointers, laid out like the page
+// tables: four levels of 512 slots, covering 48-bit physical addresses
+#define RADIX_LEVELS 4
+#define RADIX_BITS 9
+#define RADIX_SLOTS (1 << RADIX_BITS)
+#define RADIX_MAX_KEY ((1ULL << (RADIX_LEVELS * RADIX_BITS)) - 1)
+
+typedef struct radix_node_t {
+    void *slots[RADIX_SLOTS];
+    // non-empty slots; a node is freed when this drops to 0
+    uint64_t used;
+} radix_node_t;
+
+typedef struct radix_tree_t {
+    radix_node_t *root;
+    // nodes allocated, for statistics
+    uint64_t nodes;
+} radix_tree_t;
+
+#define RADIX_TREE_INIT { 0, 0 }
+
+void radix_init(radix_tree_t *tree);
+// returns 0 for keys never set
+void *radix_get(radix_tree_t *tree, uint64_t key);
+// setting 0 removes the key; returns 0 on success, 1 if out of memory and
+// -1 for keys above RADIX_MAX_KEY
+int radix_set(radix_tree_t *tree, uint64_t key, void *value);
+
+#endif
@@ -0,0 +1,79 @@
+#include "heap.h"
+#include "slab.h"
+
+static slab_cache_t *slab_list;
+static int slab_list_lock;
+
+void slab_init(slab_cache_t *cache, const char *name, uint64_t size,
+    void (*ctor)(void *object)) {
+
+    slab_cache_t init = SLAB_CACHE_INIT(name, size, ctor);
+    *cache = init;
+}
+
+// objects are followed by their free-list link
+static uint64_t slab_stride(slab_cache_t *cache) {
+    return ((cache->size + 7) & ~7ULL) + 8;
+}
+
+static void **slab_link(slab_cache_t *cache, void *object) {
+    return (void **)((uint8_t *)object + slab_stride(cache) - 8);
+}
+
+// carves a new slab into constructed objects on the free list; the caller
+// must hold the cache lock
+static int slab_grow(slab_cache_t *cache) {
+    uint64_t stride = slab_stride(cache);
+    uint64_t count = SLAB_BYTES / stride;
+    if(count < 8) count = 8;
+
+    uint8_t *slab = heap_alloc(count * stride);
+    if(!slab) return 1;
+
+    for(uint64_t i = 0; i < count; i ++) {
+        void *object = slab + i * stride;
+        if(cache->ctor) cache->ctor(object);
+        *slab_link(cache, object) = cache->free_list;
+        cache->free_list = object;
+    }
+
+    if(cache->slabs++ == 0) {
+        heap_lock(&slab_list_lock);
+        cache->next = slab_list;
+        slab_list = cache;
+        heap_unlock(&slab_list_lock);
+    }
+    cache->total += count;
+    return 0;
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+    heap_lock(&cache->lock);
+
+    if(!cache->free_list && slab_grow(cache)) {
+        heap_unlock(&cache->lock);
+        return 0;
+    }
+
+    void *object = cache->free_list;
+    cache->free_list = *slab_link(cache, object);
+    cache->active ++;
+    cache->allocs ++;
+
+    heap_unlock(&cache->lock);
+    return object;
+}
+
+void slab_free(slab_cache_t *cache, void *object) {
+    if(!object) return;
+
+    heap_lock(&cache->lock);
+    *slab_link(cache, object) = cache->free_list;
+    cache->free_list = object;
+    cache->active --;
+    heap_unlock(&cache->lock);
+}
+
+slab_cache_t *slab_caches(void) {
+    return slab_list;
+}
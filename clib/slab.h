@@ -0,0 +1,41 @@
+#ifndef CLIB_SLAB_H
+#define CLIB_SLAB_H
+
+#include <stdint.h>
+
+// caches of fixed-size objects, carved out of larger heap blocks. Objects
+// are constructed once, when their slab is made, and must be freed in
+// their constructed state. Slabs are never given back to the heap.
+typedef struct slab_cache_t {
+    const char *name;
+    uint64_t size;
+    void (*ctor)(void *object);
+
+    // free objects, linked through the qword just past each object
+    void *free_list;
+    int lock;
+
+    // statistics, in objects unless noted
+    uint64_t slabs;
+    uint64_t total;
+    uint64_t active;
+    uint64_t allocs;
+
+    // every cache that has made a slab so far
+    struct slab_cache_t *next;
+} slab_cache_t;
+
+#define SLAB_CACHE_INIT(name, size, ctor) \
+    { (name), (size), (ctor), 0, 0, 0, 0, 0, 0, 0 }
+
+// heap block each slab is carved from
+#define SLAB_BYTES 0x1000
+
+void slab_init(slab_cache_t *cache, const char *name, uint64_t size,
+    void (*ctor)(void *object));
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *object);
+
+slab_cache_t *slab_caches(void);
+
+#endif
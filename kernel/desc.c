@@ -41,6 +41,20 @@ static void gdt_set_data(uint64_t index) {
     gdt_memory[index] |= 1ULL<<(9+32);
 }
 
+static void gdt_set_tss(uint64_t index, uint64_t base, uint64_t limit) {
+    uint64_t *gdt_memory = (uint64_t *)DESC_GDT_ADDR;
+    // system descriptors take up two entries in long mode
+    gdt_memory[index] = limit & 0xffff;
+    gdt_memory[index] |= (base & 0xffffff) << 16;
+    // type (0x9 is an available 64-bit TSS)
+    gdt_memory[index] |= 0x9ULL << (8+32);
+    // set P (present) flag
+    gdt_memory[index] |= 1ULL<<(15+32);
+    gdt_memory[index] |= ((limit >> 16) & 0xf) << (16+32);
+    gdt_memory[index] |= ((base >> 24) & 0xff) << (24+32);
+    gdt_memory[index + 1] = base >> 32;
+}
+
 static void idt_set(uint64_t index, uint64_t entry, uint8_t dpl, uint8_t ist) {
     uint64_t *idt = (uint64_t *)DESC_IDT_ADDR;
     // clear IDT entries
@@ -67,13 +81,30 @@ static void idt_set(uint64_t index, uint64_t entry, uint8_t dpl, uint8_t ist) {
 
 void desc_init() {
     uint64_t gdt_page = kmem_getpage();
-    kmem_map(kmem_boot(), DESC_GDT_ADDR, gdt_page, KMEM_MAP_DEFAULT);
+    kmem_map(kmem_boot(), DESC_GDT_ADDR, gdt_page,
+        KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
 
     gdt_set_null(0);
     gdt_set_code(1, 0);
     gdt_set_data(2);
     gdt_set_code(3, 3);
 
+    // the TSS only holds interrupt stack pointers
+    uint64_t tss_page = kmem_getpage();
+    kmem_map(kmem_boot(), DESC_TSS_ADDR, tss_page,
+        KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
+    for(uint64_t off = 0; off < DESC_IST_STACK_SIZE; off += 0x1000) {
+        kmem_map(kmem_boot(), DESC_IST_STACK_ADDR + off, kmem_getpage(),
+            KMEM_MAP_DATA | KMEM_MAP_GLOBAL);
+    }
+    mem_set((void *)DESC_TSS_ADDR, 0, 104);
+    // IST pointers start at offset 36, one qword each
+    *(uint64_t *)(DESC_TSS_ADDR + 36 + (DESC_IST_FAULT-1)*8) =
+        DESC_IST_STACK_ADDR + DESC_IST_STACK_SIZE;
+    // no I/O permission bitmap
+    *(uint16_t *)(DESC_TSS_ADDR + 102) = 104;
+    gdt_set_tss(4, DESC_TSS_ADDR, 104 - 1);
+
     /* load new GDT */
     __asm__ __volatile__(
         "pushq %%rax \n"
@@ -84,27 +115,34 @@ void desc_init() {
         :
         : "a"(DESC_GDT_ADDR));
 
+    /* load TSS */
+    __asm__ __volatile__("ltr %%ax" : : "a"(4 * 8));
+
     uint64_t idt_page = kmem_getpage();
-    kmem_map(kmem_boot(), DESC_IDT_ADDR, idt_page, KMEM_MAP_DEFAULT);
+    kmem_map(kmem_boot(), DESC_IDT_ADDR, idt_page,
+        KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
     uint64_t tasks_page = kmem_getpage();
-    kmem_map(kmem_boot(), DESC_INT_TASKS_ADDR, tasks_page, KMEM_MAP_DEFAULT);
+    kmem_map(kmem_boot(), DESC_INT_TASKS_ADDR, tasks_page,
+        KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
     // map intr pages
     for(uint64_t i = 0; i < sizeof(intr_image); i += 0x1000) {
         kmem_map(kmem_boot(), DESC_INT_CODE_ADDR + i, kmem_getpage(),
-            KMEM_MAP_DEFAULT);
+            KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
     }
 
     mem_copy((void *)DESC_INT_CODE_ADDR, intr_image, sizeof(intr_image));
     // protect intr pages
     for(uint64_t i = 0; i < sizeof(intr_image); i += 0x1000) {
-        kmem_set_flags(kmem_boot(), DESC_INT_CODE_ADDR, KMEM_MAP_CODE);
+        kmem_set_flags(kmem_boot(), DESC_INT_CODE_ADDR + i,
+            KMEM_MAP_CODE | KMEM_MAP_GLOBAL);
     }
 
-    // TODO: set up TSS for IST
     for(int i = 0; i < 256; i ++) {
         DESC_INT_TASKS_MEM[i] = 0;
         idt_set(i, *(uint64_t *)(DESC_INT_CODE_ADDR + i*8), 0, 0);
     }
+    // page faults may come from running off the end of the stack
+    idt_set(14, *(uint64_t *)(DESC_INT_CODE_ADDR + 14*8), 0, DESC_IST_FAULT);
 
     /* load new IDT */
     __asm__ __volatile__(
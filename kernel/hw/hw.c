@@ -14,6 +14,7 @@
 #include "pci.h"
 #include "ioapic.h"
 #include "apics.h"
+#include "numa.h"
 
 #include "rlib/global.h"
 #include "rlib/heap.h"
@@ -191,6 +192,8 @@ void _start() {
 
     // initialize BSP local APIC and I/O APICs
     apics_init();
+    // split the frame allocator by node before drivers start allocating
+    numa_init();
 
     pci_probe_all();
     d_printf("PCI devices probed\n");
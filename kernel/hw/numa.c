@@ -0,0 +1,106 @@
+#include "klib/d.h"
+#include "klib/kmem.h"
+
+#include "acpica/acpi.h"
+
+#include "rlib/mman.h"
+
+#include "numa.h"
+
+// proximity domain of each node; the scheduler wants dense node numbers
+static uint32_t domains[KMEM_MAX_NODES];
+static uint64_t node_count;
+
+// returns the node for a proximity domain, adding one if it is new, or -1
+// if there are too many
+static uint64_t domain_node(uint32_t domain) {
+    for(uint64_t i = 0; i < node_count; i ++) {
+        if(domains[i] == domain) return i;
+    }
+    if(node_count == KMEM_MAX_NODES) return -1;
+
+    domains[node_count] = domain;
+    return node_count++;
+}
+
+// entries are only looked at if they lie within the table and are as long
+// as their type says; disabled ones don't get a node
+static void parse_srat(ACPI_TABLE_SRAT *srat) {
+    uint8_t *begin = (void *)(srat + 1);
+    if(srat->Header.Length < sizeof(*srat)) return;
+    uint64_t length = srat->Header.Length - sizeof(*srat);
+
+    uint64_t offset = 0;
+    while(offset + sizeof(ACPI_SUBTABLE_HEADER) <= length) {
+        ACPI_SUBTABLE_HEADER *sheader = (void *)(begin + offset);
+        if(sheader->Length < sizeof(*sheader)) break;
+        if(offset + sheader->Length > length) break;
+
+        if(sheader->Type == ACPI_SRAT_TYPE_MEMORY_AFFINITY
+            && sheader->Length >= sizeof(ACPI_SRAT_MEM_AFFINITY)) {
+
+            ACPI_SRAT_MEM_AFFINITY *mem = (void *)sheader;
+            uint64_t node = (mem->Flags & ACPI_SRAT_MEM_ENABLED)
+                ? domain_node(mem->ProximityDomain) : (uint64_t)-1;
+            if(node != (uint64_t)-1) {
+                rlib_numa_range(mem->BaseAddress, mem->Length, node);
+            }
+        }
+        else if(sheader->Type == ACPI_SRAT_TYPE_CPU_AFFINITY
+            && sheader->Length >= sizeof(ACPI_SRAT_CPU_AFFINITY)) {
+
+            ACPI_SRAT_CPU_AFFINITY *cpu = (void *)sheader;
+            uint32_t domain = cpu->ProximityDomainLo
+                | (cpu->ProximityDomainHi[0] << 8)
+                | (cpu->ProximityDomainHi[1] << 16)
+                | ((uint32_t)cpu->ProximityDomainHi[2] << 24);
+            uint64_t node = (cpu->Flags & ACPI_SRAT_CPU_ENABLED)
+                ? domain_node(domain) : (uint64_t)-1;
+            if(node != (uint64_t)-1) rlib_numa_cpu(cpu->ApicId, node);
+        }
+        else if(sheader->Type == ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY
+            && sheader->Length >= sizeof(ACPI_SRAT_X2APIC_CPU_AFFINITY)) {
+
+            ACPI_SRAT_X2APIC_CPU_AFFINITY *cpu = (void *)sheader;
+            uint64_t node = (cpu->Flags & ACPI_SRAT_CPU_ENABLED)
+                ? domain_node(cpu->ProximityDomain) : (uint64_t)-1;
+            if(node != (uint64_t)-1) rlib_numa_cpu(cpu->ApicId, node);
+        }
+
+        offset += sheader->Length;
+    }
+}
+
+// SLIT localities are proximity domains, so only those seen in the SRAT
+// can be translated
+static void parse_slit(ACPI_TABLE_SLIT *slit) {
+    uint64_t count = slit->LocalityCount;
+    if(sizeof(*slit) - 1 + count * count > slit->Header.Length) return;
+
+    for(uint64_t from = 0; from < node_count; from ++) {
+        if(domains[from] >= count) continue;
+        for(uint64_t to = 0; to < node_count; to ++) {
+            if(domains[to] >= count) continue;
+
+            rlib_numa_distance(from, to,
+                slit->Entry[domains[from] * count + domains[to]]);
+        }
+    }
+}
+
+void numa_init() {
+    ACPI_TABLE_HEADER *srat_header;
+    if(AcpiGetTable(ACPI_SIG_SRAT, 1, &srat_header) != AE_OK) {
+        d_printf("No SRAT, treating memory as a single node\n");
+        return;
+    }
+    parse_srat((void *)srat_header);
+
+    ACPI_TABLE_HEADER *slit_header;
+    if(AcpiGetTable(ACPI_SIG_SLIT, 1, &slit_header) == AE_OK) {
+        parse_slit((void *)slit_header);
+    }
+
+    rlib_numa_apply();
+    d_printf("NUMA: %x node(s)\n", node_count);
+}
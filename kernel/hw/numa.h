@@ -0,0 +1,6 @@
+#ifndef HW_NUMA_H
+#define HW_NUMA_H
+
+void numa_init();
+
+#endif
@@ -2,6 +2,9 @@
 [ORG 0xffffffffffe00000]
 
 task_state_region	equ 0xffffffffffe01000
+pcid_flush_region	equ 0xfffffffffff01000
+pcid_run_region		equ 0xfffffffffff03000
+pcid_cpus		equ 16
 
 ; Expected as input:
 ;	rdi: points to task state structure to store state into
@@ -64,16 +67,47 @@ transfer_control:
 	mov	dword [rdi + 25*8 + 4], edx
 
 	mov	rax, cr3
-	mov	qword [rdi + 26*8], rax
+	; keep tagged address spaces switching without a flush
+	mov	rbx, rax
+	test	rbx, 0xfff
+	jz	.save_cr3
+	bts	rbx, 63
+.save_cr3:
+	mov	qword [rdi + 26*8], rbx
 
 .skip_save:
 	; finished storing everything
 
-	; swap paging structures if required
+	; swap paging structures if required; rax only holds cr3 if the state
+	; was saved above, so read it again
+	mov	rax, cr3
 	mov	rbx, qword [rsi + 26*8]
-	cmp	rax, rbx
+	; the no-flush bit never reads back, so compare without it
+	mov	rcx, rbx
+	btr	rcx, 63
+	cmp	rax, rcx
 	je	.skip_swap
 
+	; a tagged address space is switched to without flushing its PCID,
+	; unless this CPU's copy of the PCID has been marked as holding stale
+	; translations. The CPU also notes that it has run the PCID, so that
+	; shootdowns for it reach this CPU; that happens before the flush bit
+	; is checked and CR3 loaded
+	bt	rbx, 63
+	jnc	.load_cr3
+	mov	r8, rbx
+	and	r8, 0xfff
+	; TSC_AUX holds the CPU number; rdx and rax are restored below
+	rdtscp
+	cmp	ecx, pcid_cpus
+	jae	.flush_pcid
+	shl	rcx, 9
+	lock bts	qword [pcid_run_region + rcx], r8
+	lock btr	qword [pcid_flush_region + rcx], r8
+	jnc	.load_cr3
+.flush_pcid:
+	btr	rbx, 63
+.load_cr3:
 	mov	cr3, rbx
 .skip_swap:
 	; save "restored-into" task state pointer
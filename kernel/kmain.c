@@ -4,6 +4,7 @@
 
 #include "klib/task.h"
 #include "klib/phy.h"
+#include "klib/lapic.h"
 
 #include "d.h"
 #include "kmem.h"
@@ -14,17 +15,20 @@ const uint8_t transfer_image[] = {
 #include "images/transfer.h"
 };
 
-const uint8_t scheduler_image[] = {
+// page-aligned so that read-only segments can be mapped in place
+const uint8_t scheduler_image[] __attribute__((aligned(0x1000))) = {
 #include "images/scheduler.h"
 };
 
-const uint8_t hw_image[] = {
+const uint8_t hw_image[] __attribute__((aligned(0x1000))) = {
 #include "images/hw.h"
 };
 
 void kmain(uint64_t *mem) {
     d_init(); // set up the serial port
     d_printf("Rebooting...\n");
+    // the boot processor's ID, for kmem's per-CPU caches
+    lapic_cache_id();
     kmem_init(mem); // initialize bootstrap memory manager
 
     // task initialization
@@ -32,23 +36,32 @@ void kmain(uint64_t *mem) {
         uint64_t transfer_page = kmem_getpage();
         // map as data initially
         kmem_map(kmem_boot(), TASK_BASE, transfer_page,
-            KMEM_MAP_DEFAULT);
+            KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
         mem_copy((void *)TASK_BASE, transfer_image, sizeof(transfer_image));
         // remap as code
         kmem_map(kmem_boot(), TASK_BASE, transfer_page,
-            KMEM_MAP_CODE);
+            KMEM_MAP_CODE | KMEM_MAP_GLOBAL);
 
         /* map task memory */
         uint64_t ptr = TASK_BASE + 0x1000;
         for(int i = 0; i < NUM_TASKS; i += 16) {
             uint64_t page = kmem_getpage();
-            kmem_map(kmem_boot(), ptr, page, KMEM_MAP_DEFAULT);
+            kmem_map(kmem_boot(), ptr, page,
+                KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
 
             ptr += 0x1000;
         }
         // clear task memory
         mem_set((void *)(TASK_BASE + 0x1000), 0, NUM_TASKS * 256);
 
+        // per-CPU PCID flush and run bitmaps, right after the task states
+        uint64_t bitmaps = 2 * TASK_PCID_CPUS * TASK_PCID_BITMAP_SIZE;
+        for(uint64_t off = 0; off < bitmaps; off += 0x1000) {
+            kmem_map(kmem_boot(), (uint64_t)TASK_PCID_FLUSH(0) + off,
+                kmem_getpage(), KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
+        }
+        mem_set(TASK_PCID_FLUSH(0), 0, bitmaps);
+
         // mark task #0 as valid, this will be used as temporary stack space
         // by the switcher
         TASK_MEM(0)->state = TASK_STATE_VALID;
@@ -61,7 +74,8 @@ void kmain(uint64_t *mem) {
     }
 
     // create status page
-    kmem_map(kmem_current(), STATUS_BASE, kmem_getpage(), KMEM_MAP_RO_DATA);
+    kmem_map(kmem_current(), STATUS_BASE, kmem_getpage(),
+        KMEM_MAP_RO_DATA | KMEM_MAP_GLOBAL);
 
     void (*transfer)(void *, void *) = (void *)0xffffffffffe00000;
 
@@ -70,7 +84,8 @@ void kmain(uint64_t *mem) {
     *TASK_MEM(1) = *schts;
     schts->state = 0;
     schts = TASK_MEM(1);
-    task_load_elf(TASK_MEM(1), scheduler_image, 0x10000);
+    // the scheduler serves page faults, so it must never cause one itself
+    task_load_elf(TASK_MEM(1), scheduler_image, 0x10000, TASK_LOAD_EAGER);
     // pass in the root CR3 for the boot process
     TASK_MEM(1)->rdi = kmem_current();
 
@@ -79,7 +94,7 @@ void kmain(uint64_t *mem) {
     *TASK_MEM(2) = *hwts;
     hwts->state = 0;
     hwts = TASK_MEM(2);
-    task_load_elf(hwts, hw_image, 0x10000);
+    task_load_elf(hwts, hw_image, 0x10000, 0);
 
     // pass in the task state for the hw thread into the scheduler
     TASK_MEM(1)->rsi = (uint64_t)TASK_MEM(2);
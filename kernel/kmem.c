@@ -2,13 +2,64 @@
 #include "klib/d.h"
 #include "klib/task.h"
 #include "klib/desc.h"
+#include "klib/kmem_private.h"
+#include "klib/lapic.h"
 
 extern char kernel_pbase;
 extern char _data_phy_end;
 
 uint64_t boot_cr3;
 
+// carves a zone off the end of the highest region that ends below limit,
+// shrinking that region; returns the zone size, or zero if none fits
+static uint64_t carve_zone(uint64_t *regions, uint64_t limit,
+    uint64_t kernel_start, uint64_t kernel_end, uint64_t *base) {
+
+    int best = -1;
+    for(int i = 0; regions[i] || regions[i+1]; i += 2) {
+        uint64_t end = regions[i] + regions[i+1];
+        if(end > limit) continue;
+        if(best < 0 || end > regions[best] + regions[best+1]) best = i;
+    }
+    if(best < 0) return 0;
+
+    // leave at least three quarters of the region on the free list
+    uint64_t size = (regions[best+1] / 4) & ~0x1fffffULL;
+    if(size > KMEM_ZONE_MAX_SIZE) size = KMEM_ZONE_MAX_SIZE;
+
+    // NOTE: the partial 2MB at the very end of the region is given up
+    uint64_t end = (regions[best] + regions[best+1]) & ~0x1fffffULL;
+    if(size == 0 || end - size <= regions[best]) return 0;
+    // don't hand out kernel load pages
+    if(end - size <= kernel_end && end > kernel_start) return 0;
+
+    *base = end - size;
+    regions[best+1] = *base - regions[best];
+    return size;
+}
+
+// takes size bytes off the end of the largest region that can spare them;
+// returns the base, or zero if none can
+static uint64_t carve_end(uint64_t *regions, uint64_t size,
+    uint64_t kernel_start, uint64_t kernel_end) {
+
+    int best = -1;
+    for(int i = 0; regions[i] || regions[i+1]; i += 2) {
+        uint64_t end = regions[i] + regions[i+1];
+        if(regions[i+1] <= size || end > KMEM_FRAME_MAX * 0x1000) continue;
+        if(end - size < kernel_end && end > kernel_start) continue;
+        if(best < 0 || regions[i+1] > regions[best+1]) best = i;
+    }
+    if(best < 0) return 0;
+
+    regions[best+1] -= size;
+    return regions[best] + regions[best+1];
+}
+
 void kmem_init(uint64_t *regions) {
+    // all memory is on node 0 until the hw task reads the NUMA topology
+    kmem_state->node_count = 1;
+
     // perform initial pass to round region start/end as appropriate
     for(int i = 0; regions[i] || regions[i+1]; i += 2) {
         uint64_t start = regions[i];
@@ -24,29 +75,88 @@ void kmem_init(uint64_t *regions) {
         regions[i+1] = end - start;
     }
 
-    // mark all pages as unused
+    // reserve physically contiguous memory for the buddy zones
     uint64_t kernel_start = (uint64_t)(&kernel_pbase);
     uint64_t kernel_end = (uint64_t)(&_data_phy_end);
+    uint64_t dma_base = 0, normal_base = 0;
+    uint64_t dma_size = carve_zone(regions, 0x100000000ULL, kernel_start,
+        kernel_end, &dma_base);
+    uint64_t normal_size = carve_zone(regions, -1ULL, kernel_start,
+        kernel_end, &normal_base);
+
+    // the frame metadata array covers every page up to the highest one
+    uint64_t frame_count = 0;
+    for(int i = 0; regions[i] || regions[i+1]; i += 2) {
+        uint64_t end = (regions[i] + regions[i+1]) / 0x1000;
+        if(end > frame_count) frame_count = end;
+    }
+    if(frame_count > KMEM_FRAME_MAX) frame_count = KMEM_FRAME_MAX;
+    uint64_t frames_size =
+        (frame_count * sizeof(kmem_frame_t) + 0xfff) & ~0xfffULL;
+    uint64_t frames_base = carve_end(regions, frames_size, kernel_start,
+        kernel_end);
+    if(frames_base == 0) {
+        d_printf("no room for frame metadata!\n");
+        while(1) {}
+    }
+
+    // hand every region over as free ranges, leaving out the kernel load
+    // pages and the first 128KB; no page is touched until it is handed out
+    uint64_t total_pages = 0;
+    uint64_t low_end = 0x21000;
     for(int i = 0; regions[i] || regions[i+1]; i += 2) {
-        const uint64_t end = regions[i] + regions[i+1];
-        for(uint64_t p = regions[i]; p < end; p += 0x1000) {
-            // don't mark kernel load pages as unused
-            if(p >= kernel_start && p <= kernel_end) continue;
-            // don't use first 2MB
-            if(p <= 0x20000) continue;
-
-            kmem_unuse(p);
+        uint64_t start = regions[i];
+        uint64_t end = regions[i] + regions[i+1];
+        if(start < low_end) start = low_end;
+        if(start >= end) continue;
+
+        uint64_t pieces[4] = {start, end, 0, 0};
+        // kernel_end itself is a load page
+        uint64_t kend = (kernel_end & ~0xfffULL) + 0x1000;
+        if(kend > start && kernel_start < end) {
+            pieces[1] = kernel_start > start ? kernel_start & ~0xfffULL : start;
+            pieces[2] = kend < end ? kend : end;
+            pieces[3] = end;
+        }
+
+        for(int p = 0; p < 4; p += 2) {
+            if(pieces[p+1] <= pieces[p]) continue;
+            kmem_unuse_range(pieces[p], pieces[p+1] - pieces[p]);
+            total_pages += (pieces[p+1] - pieces[p]) / 0x1000;
         }
     }
 
     // get boot CR3 value
     boot_cr3 = kmem_current();
 
-    // swap to global "last used" memory location
-    kmem_map(boot_cr3, KMEM_BASE_ADDR, kmem_getpage(), KMEM_MAP_DEFAULT);
-    uint64_t t = kmem_getpage();
-    kmem_unuse(t);
-    kmem_setup_bootstrap(t);
+    // tag address spaces with PCIDs when the processor supports it; CR3
+    // must have a PCID of zero when turning this on, which the boot one does.
+    // transfer_control finds its CPU's flush bitmap with RDTSCP, so that is
+    // required as well
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid"
+        : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if((ecx & (1<<17)) && lapic_has_rdtscp()) {
+        __asm__ __volatile__(
+            "mov %%cr4, %%rax \n"
+            "or $0x20000, %%rax \n"
+            "mov %%rax, %%cr4"
+            : : : "rax", "memory");
+    }
+
+    // part of the allocator state, so set up before it is moved
+    kmem_frames_setup(frames_base, frame_count);
+
+    // swap to global allocator state location
+    kmem_setup_bootstrap(boot_cr3);
+
+    kmem_zone_setup(KMEM_ZONE_DMA32, dma_base, dma_size);
+    kmem_zone_setup(KMEM_ZONE_NORMAL, normal_base, normal_size);
+
+    for(int z = 0; z < KMEM_ZONE_COUNT; z ++) {
+        total_pages += kmem_state->zones[z].pages;
+    }
+    kmem_state->total_pages = total_pages;
 }
 
 uint64_t kmem_boot() {
@@ -315,18 +315,18 @@ extern _data_phy_end
 	jl	.data_map
 
 	; Set up physical memory mapping.
-	; Map the GB via one P3 entry each.
+	; Map the GB via one P3 entry each, global since every root shares it.
 	mov	ecx, 16
 	mov	eax, 0
 	mov	ebx, 0
 .phy_repeat:
-	mov	dword [ebx + paging_phy_p3 + 0*8], 0x83 + 0x00000000
+	mov	dword [ebx + paging_phy_p3 + 0*8], 0x183 + 0x00000000
 	mov	dword [ebx + paging_phy_p3 + 0*8 + 4], eax
-	mov	dword [ebx + paging_phy_p3 + 1*8], 0x83 + 0x40000000
+	mov	dword [ebx + paging_phy_p3 + 1*8], 0x183 + 0x40000000
 	mov	dword [ebx + paging_phy_p3 + 1*8 + 4], eax
-	mov	dword [ebx + paging_phy_p3 + 2*8], 0x83 + 0x80000000
+	mov	dword [ebx + paging_phy_p3 + 2*8], 0x183 + 0x80000000
 	mov	dword [ebx + paging_phy_p3 + 2*8 + 4], eax
-	mov	dword [ebx + paging_phy_p3 + 3*8], 0x83 + 0xc0000000
+	mov	dword [ebx + paging_phy_p3 + 3*8], 0x183 + 0xc0000000
 	mov	dword [ebx + paging_phy_p3 + 3*8 + 4], eax
 
 	inc	eax
@@ -16,6 +16,8 @@ enum {
     SCHED_SPAWN,
     SCHED_SET_STATE,
     SCHED_REAP,
+    SCHED_MAP_DMA,
+    SCHED_SET_NUMA,
 };
 
 enum {
@@ -49,6 +51,22 @@ enum {
     SCHED_STATE
 };
 
+// map_anonymous flags
+#define SCHED_MAP_HUGE 0x01
+#define SCHED_MAP_RESERVE 0x02
+#define SCHED_MAP_GUARD 0x04
+
+// map_mirror flags
+#define SCHED_MIRROR_COW 0x01
+
+// set_numa kinds
+enum {
+    SCHED_NUMA_RANGE, // a: base, b: size, c: node
+    SCHED_NUMA_CPU, // a: APIC ID, b: node
+    SCHED_NUMA_DISTANCE, // a: from node, b: to node, c: distance
+    SCHED_NUMA_APPLY, // start allocating by node
+};
+
 typedef struct sched_in_packet_t {
     uint8_t type;
     uint64_t req_id;
@@ -71,6 +89,7 @@ typedef struct sched_in_packet_t {
             uint64_t root_id;
             uint64_t address;
             uint64_t size;
+            uint64_t flags;
         } map_anonymous;
         struct {
             uint64_t root_id;
@@ -84,6 +103,7 @@ typedef struct sched_in_packet_t {
             uint64_t oroot_id;
             uint64_t oaddress;
             uint64_t size;
+            uint64_t flags;
         } map_mirror;
         struct {
             uint64_t root_id;
@@ -108,6 +128,17 @@ typedef struct sched_in_packet_t {
         struct {
             uint64_t task_id;
         } reap;
+        struct {
+            uint64_t root_id;
+            uint64_t address;
+            uint64_t size;
+        } map_dma;
+        struct {
+            uint64_t kind;
+            uint64_t a;
+            uint64_t b;
+            uint64_t c;
+        } set_numa;
     };
 } sched_in_packet_t;
 
@@ -123,6 +154,9 @@ typedef struct sched_out_packet_t {
             uint64_t task_id;
             uint64_t root_id;
         } spawn;
+        struct {
+            uint64_t phy_addr;
+        } map_dma;
     };
 } sched_out_packet_t;
 
@@ -1,29 +1,36 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#include "clib/avl.h"
-#include "clib/heap.h"
+#include "clib/slab.h"
 
 #include "klib/d.h"
+#include "klib/kmem.h"
 #include "klib/task.h"
 #include "klib/synch.h"
 
 #include "comm.h"
 #include "listen.h"
 #include "interface.h"
-#include "id.h"
 #include "mman.h"
 #include "task.h"
 #include "synch.h"
+#include "stats.h"
 
 typedef struct {
     uint64_t task_id;
     task_info_t *info;
 } queue_entry;
 
-queue_entry queue[100];
+// every task has a slot, so the queue can't outgrow the task table
+queue_entry queue[TASK_MAX_SLOTS];
 int queue_size;
+// position of each task in queue[], by task slot
+static int queue_index[TASK_MAX_SLOTS];
 
+static slab_cache_t info_cache =
+    SLAB_CACHE_INIT("task_info_t", sizeof(task_info_t), 0);
+
+static void add_to_queue(uint64_t id, task_info_t *info);
 static void remove_from_queue(uint64_t id);
 
 // task data structures
@@ -87,8 +94,14 @@ static int process(queue_entry *q) {
         case SCHED_MAP_ANONYMOUS: {
             uint64_t id = in.map_anonymous.root_id;
             if(id == 0) id = q->info->root_id;
+            uint64_t flags = 0;
+            if(in.map_anonymous.flags & SCHED_MAP_HUGE) flags |= MMAN_MAP_HUGE;
+            if(in.map_anonymous.flags & SCHED_MAP_RESERVE) {
+                flags |= MMAN_MAP_RESERVE;
+            }
+            if(in.map_anonymous.flags & SCHED_MAP_GUARD) flags |= MMAN_MAP_GUARD;
             status.result = mman_anonymous(id, in.map_anonymous.address,
-                in.map_anonymous.size);
+                in.map_anonymous.size, flags);
             break;
         }
         case SCHED_MAP_PHYSICAL: {
@@ -101,9 +114,40 @@ static int process(queue_entry *q) {
         case SCHED_MAP_MIRROR: {
             uint64_t id = in.map_mirror.root_id;
             if(id == 0) id = q->info->root_id;
+            uint64_t flags = 0;
+            if(in.map_mirror.flags & SCHED_MIRROR_COW) flags |= MMAN_MIRROR_COW;
             status.result =
                 mman_mirror(id, in.map_mirror.address, in.map_mirror.oroot_id,
-                    in.map_mirror.oaddress, in.map_mirror.size);
+                    in.map_mirror.oaddress, in.map_mirror.size, flags);
+            break;
+        }
+        case SCHED_MAP_DMA: {
+            uint64_t id = in.map_dma.root_id;
+            if(id == 0) id = q->info->root_id;
+            status.map_dma.phy_addr = 0;
+            status.result = mman_dma(id, in.map_dma.address, in.map_dma.size,
+                &status.map_dma.phy_addr);
+            break;
+        }
+        case SCHED_SET_NUMA: {
+            uint64_t a = in.set_numa.a, b = in.set_numa.b, c = in.set_numa.c;
+            switch(in.set_numa.kind) {
+            case SCHED_NUMA_RANGE:
+                status.result = kmem_numa_add_range(a, b, c);
+                break;
+            case SCHED_NUMA_CPU:
+                status.result = kmem_numa_set_cpu(a, b);
+                break;
+            case SCHED_NUMA_DISTANCE:
+                status.result = kmem_numa_set_distance(a, b, c);
+                break;
+            case SCHED_NUMA_APPLY:
+                status.result = kmem_numa_apply();
+                break;
+            default:
+                status.result = -1;
+                break;
+            }
             break;
         }
         case SCHED_UNMAP: {
@@ -129,15 +173,14 @@ static int process(queue_entry *q) {
         case SCHED_SPAWN: {
             uint64_t root_id = in.spawn.root_id;
             if(root_id == 0) root_id = q->info->root_id;
-            task_info_t *info = heap_alloc(sizeof(*info));
+            task_info_t *info = slab_alloc(&info_cache);
             uint64_t task_id = sched_task_create(root_id, info);
 
             status.spawn.root_id = root_id;
             status.spawn.task_id = task_id;
 
-            queue[queue_size].task_id = task_id;
-            queue[queue_size].info = info;
-            queue_size ++;
+            if(task_id == (uint64_t)-1) slab_free(&info_cache, info);
+            else add_to_queue(task_id, info);
 
             break;
         }
@@ -153,10 +196,11 @@ static int process(queue_entry *q) {
                 // definitely don't send status update if reaping self...
                 status.req_id = 0;
             }
-            task_info_t *info = q->info;
-            sched_task_reap(id);
-            remove_from_queue(id);
-            heap_free(info);
+            task_info_t *info = sched_task_reap(id);
+            if(info) {
+                remove_from_queue(id);
+                slab_free(&info_cache, info);
+            }
 
             break;
         }
@@ -173,45 +217,58 @@ static int process(queue_entry *q) {
     return ret;
 }
 
+static void add_to_queue(uint64_t id, task_info_t *info) {
+    queue[queue_size].task_id = id;
+    queue[queue_size].info = info;
+    queue_index[TASK_ID_SLOT(id)] = queue_size;
+    queue_size ++;
+}
+
+static queue_entry *find_in_queue(uint64_t id) {
+    int i = queue_index[TASK_ID_SLOT(id)];
+    if(i < queue_size && queue[i].task_id == id) return queue + i;
+    return 0;
+}
+
 static void remove_from_queue(uint64_t id) {
-    for(int i = 0; i < queue_size; i ++) {
-        if(queue[i].task_id == id) {
-            queue[i] = queue[queue_size-1];
-            queue_size --;
-            break;
-        }
-    }
+    queue_entry *q = find_in_queue(id);
+    if(!q) return;
+
+    // the last entry moves into the gap
+    *q = queue[queue_size-1];
+    queue_index[TASK_ID_SLOT(q->task_id)] = q - queue;
+    queue_size --;
 }
 
 void listen(task_state_t *hw_task) {
     queue_size = 0;
 
     {
-        task_info_t *info = heap_alloc(sizeof(*info));
+        task_info_t *info = slab_alloc(&info_cache);
         // add hw task to queue
-        queue[queue_size].task_id = sched_task_attach(hw_task, info);
-        queue[queue_size].info = info;
-        queue_size ++;
+        add_to_queue(sched_task_attach(hw_task, info), info);
 
         hw_task->state |= TASK_STATE_RUNNABLE;
     }
 
+    stats_init(queue[0].task_id);
+
     while(1) {
         int any = 0;
         for(int i = 0; i < queue_size; i ++) {
             any |= process(queue + i);
         }
         if(!any) {
+            // nothing to do: top up the zeroed page pool and refresh the
+            // status page before yielding
+            kmem_zero_refill(KMEM_ZERO_BATCH);
+            stats_update();
             __asm__ __volatile__("int $0xff");
         }
     }
 }
 
 void process_for(uint64_t task_id) {
-    for(int i = 0; i < queue_size; i ++) {
-        if(queue[i].task_id == task_id) {
-            process(queue + i);
-            break;
-        }
-    }
+    queue_entry *q = find_in_queue(task_id);
+    if(q) process(q);
 }
@@ -1,31 +1,67 @@
-#include "clib/avl.h"
+#include "clib/avl64.h"
+#include "clib/heap.h"
 
 #include "klib/kmem.h"
 #include "klib/d.h"
 #include "klib/phy.h"
+#include "klib/task.h"
+#include "klib/desc.h"
+
+#include "kernel/status.h"
 
 #include "id.h"
 #include "mman.h"
+#include "tlb.h"
+
+#define PHY_MAP_BASE 0xffffc00000000000ULL
+
+// per-root bookkeeping
+typedef struct mman_root_t {
+    uint64_t id;
+    uint64_t cr3;
+    uint64_t refcount;
+    // page-table pages reachable from cr3, cr3 included
+    uint64_t table_pages;
+    // TLB tag, or 0 for an untagged root that is flushed on every switch
+    uint64_t pcid;
+    // 4KB pages mapped present, large leaves counted in 4KB pages
+    uint64_t resident;
+    // in root_map keyed by id, and in cr3_map keyed by cr3
+    avl64_node_t id_node, cr3_node;
+} mman_root_t;
 
 // memory management data structures
-avl_tree_t root_map;
-avl_tree_t root_refcount;
-avl_tree_t page_refcount;
+avl64_tree_t root_map;
+avl64_tree_t cr3_map; // map from root CR3 to mman_root_t *
 
 uint64_t this_root_id;
 static void (*pagefree_callback)(uint64_t address);
 
+// page-table pages released by unmapping, across all roots
+static uint64_t tables_reclaimed;
+
+// while set, released frames wait for the TLB flush before being reused
+static tlb_gather_t *active_gather;
+
+// PCID 0 is kept for untagged roots
+static uint64_t pcid_used[KMEM_PCID_COUNT / 64];
+static mman_root_t *pcid_owner[KMEM_PCID_COUNT];
+static uint64_t pcid_next = 1;
+
 static void increment_page(uint64_t page);
 static void decrement_page(uint64_t page);
+static void increment_pages(uint64_t page, uint64_t count);
+static void decrement_pages(uint64_t page, uint64_t count);
+static void claim_pages(uint64_t page, uint64_t count, mman_root_t *root,
+    uint32_t flags);
 static uint64_t import_root(uint64_t root);
-static void remove_helper(uint64_t root, int level);
+static void remove_helper(uint64_t table, int level, uint64_t base);
 
 void mman_init(uint64_t bootproc_cr3) {
     kmem_setup();
 
-    avl_initialize(&root_map, avl_ptrcmp, 0);
-    avl_initialize(&root_refcount, avl_ptrcmp, 0);
-    avl_initialize(&page_refcount, avl_ptrcmp, 0);
+    avl64_initialize(&root_map);
+    avl64_initialize(&cr3_map);
 
     this_root_id = import_root(kmem_current());
     mman_increment_root(this_root_id);
@@ -34,48 +70,261 @@ void mman_init(uint64_t bootproc_cr3) {
     import_root(bootproc_cr3);
 }
 
-static uint64_t paging_addr_create(uint64_t root_address, uint64_t vaddr,
+static mman_root_t *get_root(uint64_t root_id) {
+    avl64_node_t *node = avl64_search(&root_map, root_id);
+    return node ? AVL64_ENTRY(node, mman_root_t, id_node) : 0;
+}
+
+// points every task running in root at its current CR3 value
+static void retag_tasks(mman_root_t *root) {
+    uint64_t value = root->cr3;
+    if(root->pcid) value |= root->pcid | KMEM_CR3_NOFLUSH;
+
+    for(uint64_t i = 1; i < NUM_TASKS; i ++) {
+        task_state_t *ts = TASK_MEM(i);
+        if(!(ts->state & TASK_STATE_VALID)) continue;
+        if((ts->cr3 & ~KMEM_FLAG_MASK) != root->cr3) continue;
+
+        ts->cr3 = value;
+    }
+}
+
+static void assign_pcid(mman_root_t *root) {
+    root->pcid = 0;
+    if(!kmem_pcid_enabled()) return;
+
+    uint64_t pcid = pcid_next;
+    for(uint64_t i = 1; i < KMEM_PCID_COUNT; i ++) {
+        if(!(pcid_used[pcid / 64] & (1ULL << (pcid % 64)))) break;
+        if(++pcid == KMEM_PCID_COUNT) pcid = 1;
+    }
+
+    // all taken: recycle one, leaving its old owner untagged
+    if(pcid_used[pcid / 64] & (1ULL << (pcid % 64))) {
+        mman_root_t *victim = pcid_owner[pcid];
+        victim->pcid = 0;
+        retag_tasks(victim);
+    }
+
+    pcid_used[pcid / 64] |= 1ULL << (pcid % 64);
+    pcid_owner[pcid] = root;
+    pcid_next = pcid + 1 == KMEM_PCID_COUNT ? 1 : pcid + 1;
+
+    // anything cached under this PCID belongs to a previous owner
+    tlb_flush_pcid(pcid);
+
+    root->pcid = pcid;
+}
+
+static void release_pcid(mman_root_t *root) {
+    if(root->pcid == 0) return;
+
+    pcid_used[root->pcid / 64] &= ~(1ULL << (root->pcid % 64));
+    pcid_owner[root->pcid] = 0;
+    root->pcid = 0;
+}
+
+// page tables created under a root hold a reference like any other page
+static void table_created(void *context, uint64_t table) {
+    mman_root_t *root = context;
+    increment_page(table);
+    claim_pages(table, 1, root, KMEM_FRAME_TABLE);
+    root->table_pages ++;
+}
+
+static uint64_t paging_addr_create(mman_root_t *root, kmem_cursor_t *cursor,
     uint8_t level) {
 
-    uint8_t ok;
-    uint64_t addr = kmem_paging_addr(root_address, vaddr, level, &ok);
-
-    if(!ok) {
-        // need to allocate some intermediate entries
-        uint64_t pa = -1;
-        for(int i = 0; i <= level; i ++) {
-            uint64_t a = kmem_paging_addr(root_address, vaddr, i, &ok);
-            if(!ok) {
-                uint64_t ntable = kmem_getpage();
-                for(int i = 0; i < 512; i ++) phy_write64(ntable + i*8, 0);
-                phy_write64(pa, ntable | 0x7);
-                increment_page(ntable);
-                a = kmem_paging_addr(root_address, vaddr, i, &ok);
-            }
-            pa = a;
-        }
+    return kmem_cursor_create(cursor, level, table_created, root);
+}
 
-        addr = kmem_paging_addr(root_address, vaddr, level, &ok);
+// number of level 3 entries from the cursor's address up to end, without
+// leaving the cursor's leaf table
+static uint64_t leaf_run(kmem_cursor_t *cursor, uint64_t end) {
+    uint64_t run = 512 - KMEM_LEVEL_INDEX(cursor->address, 3);
+    uint64_t left = (end - cursor->address) / 0x1000;
+    return run < left ? run : left;
+}
+
+// reserved and guard entries keep a table alive just as mappings do
+static int table_empty(uint64_t table) {
+    for(uint64_t i = 0; i < 512; i ++) {
+        if(phy_read64(table + i*8)) return 0;
+    }
+    return 1;
+}
+
+// backs a reserved level 3 entry with a zeroed page
+static int fill_reserved(mman_root_t *root, uint64_t eaddr) {
+    uint64_t entry = phy_read64(eaddr);
+    uint64_t page = kmem_getpage_zeroed();
+    if(page == 0) return 1;
+
+    entry &= KMEM_FLAG_MASK & ~(KMEM_PAGE_RESERVED | KMEM_PAGE_HUGE_HINT);
+    phy_write64(eaddr, page | entry | KMEM_PAGE_PRESENT);
+    increment_page(page);
+    claim_pages(page, 1, root, 0);
+    root->resident ++;
+
+    return 0;
+}
+
+// replaces a leaf table holding nothing but huge-hinted reservations with a
+// single 2MB frame; the cursor must be on one of its entries
+static int fill_huge(mman_root_t *root, kmem_cursor_t *cursor) {
+    uint64_t table = cursor->tables[3];
+    uint64_t entry = kmem_cursor_get(cursor);
+    for(uint64_t i = 0; i < 512; i ++) {
+        if(phy_read64(table + i*8) != entry) return 1;
+    }
+
+    uint64_t block = kmem_getblock(KMEM_ZONE_NORMAL, KMEM_MAX_ORDER);
+    if(block == 0) return 1;
+    phy_clear(block, KMEM_LEVEL_SIZE(2));
+
+    entry &= KMEM_FLAG_MASK & ~(KMEM_PAGE_RESERVED | KMEM_PAGE_HUGE_HINT);
+    cursor->level = 2;
+    kmem_cursor_set(cursor, block | entry | KMEM_PAGE_PRESENT
+        | KMEM_PAGE_LARGE);
+    increment_pages(block, KMEM_LEVEL_SIZE(2) / 0x1000);
+    claim_pages(block, KMEM_LEVEL_SIZE(2) / 0x1000, root, 0);
+    root->resident += KMEM_LEVEL_SIZE(2) / 0x1000;
+
+    // the old table may still be cached as the way down to this address
+    tlb_gather_t gather;
+    tlb_gather_begin(&gather, mman_get_root_task_cr3(root->id));
+    active_gather = &gather;
+    tlb_gather_add(&gather, cursor->address);
+    decrement_page(table);
+    root->table_pages --;
+    active_gather = 0;
+    tlb_gather_flush(&gather);
+
+    return 0;
+}
+
+// releases the tables holding the cursor's entry for as long as they map
+// nothing, leaving the cursor on the cleared entry that pointed to them. The
+// paging-structure caches may still hold the way through a released table
+// even if nothing in it was present, so the gather must cover its range
+// before the frame is reused.
+static void reclaim_tables(mman_root_t *root, kmem_cursor_t *cursor,
+    tlb_gather_t *gather) {
+
+    while(cursor->level > 0 && table_empty(cursor->tables[cursor->level])) {
+        uint64_t table = cursor->tables[cursor->level];
+        cursor->level --;
+        kmem_cursor_set(cursor, 0);
+        tlb_gather_add(gather, cursor->address);
+
+        decrement_page(table);
+        root->table_pages --;
+        tables_reclaimed ++;
     }
+}
+
+// maps a 2MB or 1GB frame with a single level 2 or level 1 entry, if
+// nothing is there yet
+static int anonymous_large(mman_root_t *root, kmem_cursor_t *cursor,
+    uint8_t level) {
+
+    uint64_t eaddr = paging_addr_create(root, cursor, level);
+    if(eaddr == 0) return 1;
+    if(phy_read64(eaddr) & KMEM_PAGE_PRESENT) return 1;
+
+    uint64_t lsize = KMEM_LEVEL_SIZE(level);
+    uint64_t block = kmem_getblock(KMEM_ZONE_NORMAL, kmem_order(lsize));
+    if(block == 0) return 1;
+    phy_clear(block, lsize);
+
+    phy_write64(eaddr, block | KMEM_MAP_DATA | KMEM_PAGE_LARGE);
+    increment_pages(block, lsize / 0x1000);
+    claim_pages(block, lsize / 0x1000, root, 0);
+    root->resident += lsize / 0x1000;
 
-    return addr;
+    return 0;
 }
 
-int mman_anonymous(uint64_t root_id, uint64_t address, uint64_t size) {
-    uint64_t root_address =
-        (uint64_t)avl_search(&root_map, (void *)root_id);
-    if(root_address == 0) return -1;
+int mman_anonymous(uint64_t root_id, uint64_t address, uint64_t size,
+    uint64_t flags) {
+
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
 
     if(address & 0xfff) return -1;
     if(size & 0xfff) return -1;
 
-    while(size > 0) {
-        uint64_t eaddr = paging_addr_create(root_address, address, 3);
-        uint64_t paddr = kmem_getpage();
-        phy_write64(eaddr, paddr | KMEM_MAP_DATA);
-        increment_page(paddr);
-        address += 0x1000;
-        size -= 0x1000;
+    uint64_t end = address + size;
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
+
+    if((flags & MMAN_MAP_GUARD) && cursor.address < end) {
+        uint64_t eaddr = paging_addr_create(root, &cursor, 3);
+        if(eaddr == 0) return 1;
+        phy_write64(eaddr, KMEM_PAGE_GUARD);
+        kmem_cursor_seek(&cursor, cursor.address + 0x1000);
+    }
+
+    while((flags & MMAN_MAP_RESERVE) && cursor.address < end) {
+        uint64_t eaddr = paging_addr_create(root, &cursor, 3);
+        if(eaddr == 0) return 1;
+
+        // pages are only filled in when touched; whole aligned 2MB stretches
+        // may be filled with a single 2MB frame instead
+        uint64_t run = leaf_run(&cursor, end);
+        for(uint64_t i = 0; i < run; i ++) {
+            uint64_t huge = (cursor.address + i*0x1000)
+                & ~(KMEM_LEVEL_SIZE(2) - 1);
+            uint64_t entry = KMEM_MAP_RESERVED;
+            if((flags & MMAN_MAP_HUGE) && huge >= address
+                && end - huge >= KMEM_LEVEL_SIZE(2)) {
+
+                entry |= KMEM_PAGE_HUGE_HINT;
+            }
+            phy_write64(eaddr + i*8, entry);
+        }
+
+        kmem_cursor_seek(&cursor, cursor.address + run * 0x1000);
+    }
+
+    while(cursor.address < end) {
+        // use the largest frame that alignment, size and memory allow
+        uint8_t level = 3;
+        for(uint8_t l = 1; l < 3 && (flags & MMAN_MAP_HUGE); l ++) {
+            uint64_t lsize = KMEM_LEVEL_SIZE(l);
+            if(cursor.address & (lsize - 1)) continue;
+            if(end - cursor.address < lsize) continue;
+            if(anonymous_large(root, &cursor, l)) continue;
+
+            level = l;
+            break;
+        }
+        if(level < 3) {
+            kmem_cursor_seek(&cursor, cursor.address + KMEM_LEVEL_SIZE(level));
+            continue;
+        }
+
+        // fill the rest of this leaf table, a batch of pages at a time
+        uint64_t eaddr = paging_addr_create(root, &cursor, 3);
+        if(eaddr == 0) return 1;
+
+        uint64_t run = leaf_run(&cursor, end);
+        uint64_t pages[KMEM_MAGAZINE_BATCH];
+        for(uint64_t i = 0; i < run; ) {
+            uint64_t count = run - i;
+            if(count > KMEM_MAGAZINE_BATCH) count = KMEM_MAGAZINE_BATCH;
+            count = kmem_getpages_zeroed(count, pages);
+            if(count == 0) return 1;
+
+            for(uint64_t j = 0; j < count; j ++, i ++) {
+                phy_write64(eaddr + i*8, pages[j] | KMEM_MAP_DATA);
+                increment_page(pages[j]);
+                claim_pages(pages[j], 1, root, 0);
+            }
+            root->resident += count;
+        }
+
+        kmem_cursor_seek(&cursor, cursor.address + run * 0x1000);
     }
 
     return 0;
@@ -84,179 +333,538 @@ int mman_anonymous(uint64_t root_id, uint64_t address, uint64_t size) {
 int mman_physical(uint64_t root_id, uint64_t address, uint64_t paddress,
     uint64_t size) {
 
-    uint64_t root_address =
-        (uint64_t)avl_search(&root_map, (void *)root_id);
-    if(root_address == 0) return -1;
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
 
     if(address & 0xfff) return -1;
     if(paddress & 0xfff) return -1;
     if(size & 0xfff) return -1;
 
-    while(size > 0) {
-        uint64_t eaddr = paging_addr_create(root_address, address, 3);
-        phy_write64(eaddr, paddress | KMEM_MAP_DATA);
+    uint64_t end = address + size;
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
 
-        address += 0x1000;
-        paddress += 0x1000;
-        size -= 0x1000;
+    while(cursor.address < end) {
+        uint64_t offset = cursor.address - address;
+
+        // use the largest leaf that alignment and size allow
+        uint8_t level = 3;
+        uint64_t eaddr = 0;
+        for(uint8_t l = 1; l < 3; l ++) {
+            uint64_t lsize = KMEM_LEVEL_SIZE(l);
+            if((cursor.address | (paddress + offset)) & (lsize - 1)) continue;
+            if(end - cursor.address < lsize) continue;
+
+            eaddr = paging_addr_create(root, &cursor, l);
+            if(eaddr == 0) return 1;
+            if(phy_read64(eaddr) & KMEM_PAGE_PRESENT) continue;
+
+            level = l;
+            break;
+        }
+
+        if(level < 3) {
+            phy_write64(eaddr, (paddress + offset)
+                | KMEM_MAP_DATA | KMEM_PAGE_LARGE);
+            root->resident += KMEM_LEVEL_SIZE(level) / 0x1000;
+            kmem_cursor_seek(&cursor, cursor.address + KMEM_LEVEL_SIZE(level));
+            continue;
+        }
+
+        // the rest of this leaf table; it ends where a 2MB leaf could start
+        eaddr = paging_addr_create(root, &cursor, 3);
+        if(eaddr == 0) return 1;
+
+        uint64_t run = leaf_run(&cursor, end);
+        for(uint64_t i = 0; i < run; i ++) {
+            phy_write64(eaddr + i*8,
+                (paddress + offset + i*0x1000) | KMEM_MAP_DATA);
+        }
+        root->resident += run;
+
+        kmem_cursor_seek(&cursor, cursor.address + run * 0x1000);
+    }
+
+    return 0;
+}
+
+int mman_dma(uint64_t root_id, uint64_t address, uint64_t size,
+    uint64_t *paddress) {
+
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
+
+    if(address & 0xfff) return -1;
+    if(size & 0xfff || size == 0) return -1;
+
+    uint64_t order = kmem_order(size);
+    uint64_t block = kmem_getblock(KMEM_ZONE_DMA32, order);
+    if(block == 0) return 1;
+
+    // give back the tail of the block beyond the requested size
+    for(uint64_t off = size; off < (0x1000ULL << order); off += 0x1000) {
+        kmem_unuse(block + off);
+    }
+    // whatever the previous owner left must not reach the task
+    phy_clear(block, size);
+
+    uint64_t end = address + size;
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
+
+    while(cursor.address < end) {
+        uint64_t eaddr = paging_addr_create(root, &cursor, 3);
+        if(eaddr == 0) {
+            // unmapping drops the references taken so far, which frees
+            // those pages; the rest were never mapped
+            uint64_t mapped = cursor.address - address;
+            if(mapped) mman_unmap(root_id, address, mapped);
+            for(uint64_t off = mapped; off < size; off += 0x1000) {
+                kmem_unuse(block + off);
+            }
+            return 1;
+        }
+
+        uint64_t page = block + (cursor.address - address);
+        uint64_t run = leaf_run(&cursor, end);
+        for(uint64_t i = 0; i < run; i ++) {
+            phy_write64(eaddr + i*8, (page + i*0x1000) | KMEM_MAP_DATA);
+            increment_page(page + i*0x1000);
+            claim_pages(page + i*0x1000, 1, root, KMEM_FRAME_DMA);
+        }
+        root->resident += run;
+
+        kmem_cursor_seek(&cursor, cursor.address + run * 0x1000);
+    }
+
+    *paddress = block;
+    return 0;
+}
+
+// fills every reserved page in a range, so that it can be shared
+static int commit_reserved(mman_root_t *root, uint64_t address,
+    uint64_t size) {
+
+    uint64_t end = address + size;
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
+
+    while(cursor.address < end) {
+        if(cursor.level == 3 && (kmem_cursor_get(&cursor) & KMEM_PAGE_RESERVED)
+            && fill_reserved(root, kmem_cursor_entry(&cursor)) != 0) {
+
+            return 1;
+        }
+
+        kmem_cursor_next(&cursor);
     }
 
     return 0;
 }
 
 int mman_check_all_mapped(uint64_t root_id, uint64_t address, uint64_t size) {
-    uint64_t root_address =
-        (uint64_t)avl_search(&root_map, (void *)root_id);
-    if(root_address == 0) return -1;
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
 
     if(address & 0xfff) return -1;
     if(size & 0xfff) return -1;
 
-    while(size > 0) {
-        uint8_t ok = 0;
-        uint64_t eaddr = kmem_paging_addr(root_address, address, 3, &ok);
-        if(!ok) {
-            d_printf("OK failed\n");
-            return 0;
-        }
-        if(!(phy_read64(eaddr) & 0x1)) {
-            d_printf("address 0x%x not present!\n", address);
+    uint64_t end = address + size;
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
+
+    while(cursor.address < end) {
+        if(!(kmem_cursor_get(&cursor) & KMEM_PAGE_PRESENT)) {
+            d_printf("address 0x%x not present!\n", cursor.address);
             return 0;
         }
 
-        address += 0x1000;
-        size -= 0x1000;
+        // skip to the end of this leaf
+        kmem_cursor_next(&cursor);
     }
 
     return 1;
 }
 
 int mman_check_any_mapped(uint64_t root_id, uint64_t address, uint64_t size) {
-    uint64_t root_address =
-        (uint64_t)avl_search(&root_map, (void *)root_id);
-    if(root_address == 0) return -1;
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
 
     if(address & 0xfff) return -1;
     if(size & 0xfff) return -1;
 
-    while(size > 0) {
-        uint8_t ok = 0;
-        uint64_t eaddr = kmem_paging_addr(root_address, address, 3, &ok);
-        if(ok) {
-            if(phy_read64(eaddr) & 0x1) return 1;
-        }
+    uint64_t end = address + size;
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
 
-        address += 0x1000;
-        size -= 0x1000;
+    while(cursor.address < end) {
+        // reserved and guard pages are taken as well
+        if(kmem_cursor_get(&cursor)) return 1;
+
+        // nothing is mapped in the rest of the region this entry covers
+        kmem_cursor_next(&cursor);
     }
 
     return 0;
 }
 
+// entry to share under copy-on-write, with write access held back
+static uint64_t cow_entry(uint64_t entry) {
+    if(entry & KMEM_PAGE_WRITE) {
+        entry = (entry & ~KMEM_PAGE_WRITE) | KMEM_PAGE_COW_WRITE;
+    }
+    return entry | KMEM_PAGE_COW;
+}
+
 int mman_mirror(uint64_t root_id, uint64_t address, uint64_t sroot_id,
-    uint64_t saddress, uint64_t size) {
+    uint64_t saddress, uint64_t size, uint64_t flags) {
 
-    uint64_t root_address =
-        (uint64_t)avl_search(&root_map, (void *)root_id);
-    if(root_address == 0) return -1;
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
 
-    uint64_t sroot_address =
-        (uint64_t)avl_search(&root_map, (void *)sroot_id);
-    if(sroot_address == 0) return -1;
+    mman_root_t *sroot = get_root(sroot_id);
+    if(sroot == 0) return -1;
 
     if(mman_check_any_mapped(root_id, address, size) != 0) return 1;
+    if(commit_reserved(sroot, saddress, size) != 0) return 1;
     if(mman_check_all_mapped(sroot_id, saddress, size) != 1) return 1;
 
-    while(size > 0) {
-        uint64_t eaddr = paging_addr_create(root_address, address, 3);
-        uint64_t saddr = paging_addr_create(sroot_address, saddress, 3);
+    // copy-on-write takes write access away from the source as well
+    int cow = !!(flags & MMAN_MIRROR_COW);
+    tlb_gather_t gather;
+    tlb_gather_begin(&gather, mman_get_root_task_cr3(sroot_id));
+
+    uint64_t end = address + size;
+    kmem_cursor_t cursor, scursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
+    kmem_cursor_begin(&scursor, sroot->cr3, saddress);
+
+    int ret = 0;
+    while(cursor.address < end) {
+        uint8_t level = scursor.level;
+        uint64_t sentry = kmem_cursor_get(&scursor);
+        uint64_t lsize = KMEM_LEVEL_SIZE(level);
+        uint64_t run;
+
+        if(cow && level < 3 && !(sentry & KMEM_PAGE_COW)) {
+            sentry = cow_entry(sentry);
+            kmem_cursor_set(&scursor, sentry);
+            tlb_gather_add(&gather, scursor.address & ~(lsize - 1));
+        }
+
+        // share a whole large leaf when both sides line up
+        if(level < 3 && ((cursor.address | scursor.address) & (lsize - 1)) == 0
+            && end - cursor.address >= lsize) {
+
+            uint64_t eaddr = paging_addr_create(root, &cursor, level);
+            if(eaddr == 0) {
+                ret = 1;
+                break;
+            }
+            if(!(phy_read64(eaddr) & KMEM_PAGE_PRESENT)) {
+                phy_write64(eaddr, sentry);
+                increment_pages(sentry & ~KMEM_FLAG_MASK, lsize / 0x1000);
+                root->resident += lsize / 0x1000;
+
+                kmem_cursor_seek(&cursor, cursor.address + lsize);
+                kmem_cursor_seek(&scursor, scursor.address + lsize);
+                continue;
+            }
+        }
 
-        uint64_t sentry = phy_read64(saddr);
-        phy_write64(eaddr, phy_read64(saddr));
-        increment_page(sentry & ~KMEM_FLAG_MASK);
+        uint64_t eaddr = paging_addr_create(root, &cursor, 3);
+        if(eaddr == 0) {
+            ret = 1;
+            break;
+        }
+
+        // as much as both this leaf table and the source leaf or leaf table
+        // cover
+        run = leaf_run(&cursor, end);
+        uint64_t srun = kmem_cursor_span(&scursor) / 0x1000;
+        if(level == 3) srun = 512 - KMEM_LEVEL_INDEX(scursor.address, 3);
+        if(run > srun) run = srun;
+
+        if(level == 3) {
+            uint64_t saddr = kmem_cursor_entry(&scursor);
+            for(uint64_t i = 0; i < run; i ++) {
+                uint64_t entry = phy_read64(saddr + i*8);
+                if(cow && !(entry & KMEM_PAGE_COW)) {
+                    entry = cow_entry(entry);
+                    phy_write64(saddr + i*8, entry);
+                    tlb_gather_add(&gather, scursor.address + i*0x1000);
+                }
+                phy_write64(eaddr + i*8, entry);
+                increment_page(entry & ~KMEM_FLAG_MASK);
+            }
+        }
+        else {
+            // 4KB pieces of a large leaf
+            uint64_t page = (sentry & ~KMEM_FLAG_MASK & ~(lsize - 1))
+                + (scursor.address & (lsize - 1));
+            uint64_t eflags = sentry & KMEM_FLAG_MASK & ~KMEM_PAGE_LARGE;
+            for(uint64_t i = 0; i < run; i ++) {
+                phy_write64(eaddr + i*8, (page + i*0x1000) | eflags);
+                increment_page(page + i*0x1000);
+            }
+        }
+        root->resident += run;
 
-        address += 0x1000;
-        saddress += 0x1000;
-        size -= 0x1000;
+        kmem_cursor_seek(&cursor, cursor.address + run * 0x1000);
+        kmem_cursor_seek(&scursor, scursor.address + run * 0x1000);
     }
 
-    return 0;
+    tlb_gather_flush(&gather);
+
+    return ret;
 }
 
 int mman_unmap(uint64_t root_id, uint64_t address, uint64_t size) {
-    uint64_t root_address =
-        (uint64_t)avl_search(&root_map, (void *)root_id);
-    if(root_address == 0) return -1;
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
 
     if(address & 0xfff) return -1;
     if(size & 0xfff) return -1;
 
-    while(size > 0) {
-        uint8_t ok;
-        uint64_t eaddr = kmem_paging_addr(root_address, address, 3, &ok);
-        if(ok) {
-            uint64_t entry = phy_read64(eaddr);
-            if(entry & 1) {
+    tlb_gather_t gather;
+    tlb_gather_begin(&gather, mman_get_root_task_cr3(root_id));
+    active_gather = &gather;
+
+    uint64_t end = address + size;
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
+
+    int ret = 0;
+    while(cursor.address < end) {
+        uint64_t entry = kmem_cursor_get(&cursor);
+        if(entry == 0) {
+            kmem_cursor_next(&cursor);
+            continue;
+        }
+
+        if(cursor.level == 3) {
+            uint64_t eaddr = kmem_cursor_entry(&cursor);
+            uint64_t run = leaf_run(&cursor, end);
+            for(uint64_t i = 0; i < run; i ++) {
+                entry = phy_read64(eaddr + i*8);
+                if(entry == 0) continue;
+
+                phy_write64(eaddr + i*8, 0);
+                // reserved and guard entries have nothing behind them
+                if(!(entry & KMEM_PAGE_PRESENT)) continue;
+
+                tlb_gather_add(&gather, cursor.address + i*0x1000);
                 decrement_page(entry & ~KMEM_FLAG_MASK);
-                phy_write64(eaddr, 0);
+                root->resident --;
+            }
+
+            reclaim_tables(root, &cursor, &gather);
+            kmem_cursor_seek(&cursor, cursor.address + run * 0x1000);
+            continue;
+        }
+
+        // a large leaf only partially covered has to be split first
+        uint64_t lsize = KMEM_LEVEL_SIZE(cursor.level);
+        if((cursor.address & (lsize - 1)) || end - cursor.address < lsize) {
+            tlb_gather_add(&gather, cursor.address);
+            if(!paging_addr_create(root, &cursor, cursor.level + 1)) {
+                ret = 1;
+                break;
             }
+            continue;
         }
 
-        address += 0x1000;
-        size -= 0x1000;
+        kmem_cursor_set(&cursor, 0);
+        tlb_gather_add(&gather, cursor.address);
+        decrement_pages(entry & ~KMEM_FLAG_MASK & ~(lsize - 1),
+            lsize / 0x1000);
+        root->resident -= lsize / 0x1000;
+
+        reclaim_tables(root, &cursor, &gather);
+        kmem_cursor_next(&cursor);
     }
 
-    return 0;
+    active_gather = 0;
+    tlb_gather_flush(&gather);
+
+    return ret;
+}
+
+// copy-on-write entries only note write access until their frame is copied
+static uint64_t protect_entry(uint64_t entry, uint64_t flags) {
+    uint64_t value = (entry & ~KMEM_FLAG_MASK) | flags;
+    if(entry & KMEM_PAGE_COW) value = cow_entry(value);
+    return value;
 }
 
 int mman_protect(uint64_t root_id, uint64_t address, uint64_t size,
     uint64_t flags) {
 
-    uint64_t root_address =
-        (uint64_t)avl_search(&root_map, (void *)root_id);
-    if(root_address == 0) return -1;
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
 
     if(address & 0xfff) return -1;
     if(size & 0xfff) return -1;
 
-    while(size > 0) {
-        uint8_t ok;
-        uint64_t eaddr = kmem_paging_addr(root_address, address, 3, &ok);
-        if(ok) {
-            uint64_t entry = phy_read64(eaddr);
-            if(entry & 1) {
-                //decrement_page(entry & ~KMEM_FLAG_MASK);
-                phy_write64(eaddr, (entry & ~KMEM_FLAG_MASK) | flags);
+    tlb_gather_t gather;
+    tlb_gather_begin(&gather, mman_get_root_task_cr3(root_id));
+
+    uint64_t end = address + size;
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address);
+
+    int ret = 0;
+    while(cursor.address < end) {
+        uint64_t entry = kmem_cursor_get(&cursor);
+
+        // leaf tables may hold nothing but reservations, which must still
+        // take the new flags; only empty entries are skipped
+        if(cursor.level == 3 && entry) {
+            uint64_t eaddr = kmem_cursor_entry(&cursor);
+            uint64_t run = leaf_run(&cursor, end);
+            for(uint64_t i = 0; i < run; i ++) {
+                entry = phy_read64(eaddr + i*8);
+
+                // reserved pages take the new flags once filled in
+                if(entry & KMEM_PAGE_RESERVED) {
+                    phy_write64(eaddr + i*8, (entry & (KMEM_PAGE_RESERVED
+                        | KMEM_PAGE_HUGE_HINT)) | (flags & ~KMEM_PAGE_PRESENT));
+                    continue;
+                }
+                if(!(entry & KMEM_PAGE_PRESENT)) continue;
+
+                phy_write64(eaddr + i*8, protect_entry(entry, flags));
+                tlb_gather_add(&gather, cursor.address + i*0x1000);
+            }
+
+            kmem_cursor_seek(&cursor, cursor.address + run * 0x1000);
+            continue;
+        }
+        if(!(entry & KMEM_PAGE_PRESENT)) {
+            kmem_cursor_next(&cursor);
+            continue;
+        }
+
+        uint64_t lsize = KMEM_LEVEL_SIZE(cursor.level);
+        if((cursor.address & (lsize - 1)) || end - cursor.address < lsize) {
+            tlb_gather_add(&gather, cursor.address);
+            if(!paging_addr_create(root, &cursor, cursor.level + 1)) {
+                ret = 1;
+                break;
             }
+            continue;
         }
 
-        address += 0x1000;
-        size -= 0x1000;
+        kmem_cursor_set(&cursor, protect_entry(entry, flags) | KMEM_PAGE_LARGE);
+        tlb_gather_add(&gather, cursor.address);
+        kmem_cursor_next(&cursor);
     }
 
-    return 0;
+    tlb_gather_flush(&gather);
+
+    return ret;
 }
 
 static void increment_page(uint64_t page) {
-    uint64_t current = (uint64_t)avl_search(&page_refcount, (void *)page);
-    avl_insert(&page_refcount, (void *)page, (void *)(current + 1));
+    kmem_frame_get(page);
 }
 
 static void decrement_page(uint64_t page) {
-    uint64_t current = (uint64_t)avl_search(&page_refcount, (void *)page);
+    // nothing to do until the last reference goes
+    if(!kmem_frame_put(page)) return;
+
+    if(pagefree_callback) pagefree_callback(page);
+    if(active_gather) tlb_gather_free(active_gather, page);
+    else kmem_unuse(page);
+}
 
-    // can't decrement a page already fully-decremented
-    if(current == 0) return;
-    // case: at least one reference remaining
-    else if(current > 1) {
-        avl_insert(&page_refcount, (void *)page, (void *)(current - 1));
+// records who a newly mapped frame belongs to and what it is used for
+static void claim_pages(uint64_t page, uint64_t count, mman_root_t *root,
+    uint32_t flags) {
+
+    for(uint64_t i = 0; i < count; i ++) {
+        kmem_frame_t *frame = kmem_frame(page + i*0x1000);
+        if(!frame) continue;
+
+        // pinned frames keep belonging to the kernel
+        if(!(frame->flags & KMEM_FRAME_PINNED)) frame->owner = root->id;
+        frame->flags |= flags;
+    }
+}
+
+static void increment_pages(uint64_t page, uint64_t count) {
+    for(uint64_t i = 0; i < count; i ++) increment_page(page + i*0x1000);
+}
+
+static void decrement_pages(uint64_t page, uint64_t count) {
+    for(uint64_t i = 0; i < count; i ++) decrement_page(page + i*0x1000);
+}
+
+// gives a copy-on-write entry its own frame, unless it is the only one left
+// using it, and hands back its write access
+static int break_cow(mman_root_t *root, kmem_cursor_t *cursor) {
+    // a large leaf is split first; only the touched 4KB gets copied
+    uint64_t eaddr = paging_addr_create(root, cursor, 3);
+    if(eaddr == 0) return 1;
+
+    uint64_t entry = phy_read64(eaddr);
+    uint64_t old = entry & ~KMEM_FLAG_MASK;
+    uint64_t flags = (entry & KMEM_FLAG_MASK
+        & ~(KMEM_PAGE_COW | KMEM_PAGE_COW_WRITE)) | KMEM_PAGE_WRITE;
+
+    tlb_gather_t gather;
+    tlb_gather_begin(&gather, mman_get_root_task_cr3(root->id));
+    active_gather = &gather;
+
+    int ret = 0;
+    kmem_frame_t *frame = kmem_frame(old);
+    if(frame && frame->refcount == 1 && !(frame->flags & KMEM_FRAME_PINNED)) {
+        phy_write64(eaddr, old | flags);
     }
-    // case: time to release
     else {
-        if(pagefree_callback) pagefree_callback(page);
-        avl_remove(&page_refcount, (void *)page);
-        kmem_unuse(page);
+        uint64_t page = kmem_getpage();
+        if(page) {
+            phy_copy(page, old, 0x1000);
+            phy_write64(eaddr, page | flags);
+            increment_page(page);
+            claim_pages(page, 1, root, 0);
+            decrement_page(old);
+        }
+        else ret = 1;
+    }
+
+    // the read-only translation may be cached
+    tlb_gather_add(&gather, cursor->address);
+    active_gather = 0;
+    tlb_gather_flush(&gather);
+
+    return ret;
+}
+
+int mman_fault(uint64_t cr3, uint64_t address, uint64_t code) {
+    avl64_node_t *node = avl64_search(&cr3_map, cr3 & ~KMEM_FLAG_MASK);
+    if(node == 0) return -1;
+    mman_root_t *root = AVL64_ENTRY(node, mman_root_t, cr3_node);
+
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root->cr3, address & ~0xfff);
+
+    uint64_t entry = kmem_cursor_get(&cursor);
+    if(entry & KMEM_PAGE_PRESENT) {
+        if((code & MMAN_FAULT_WRITE) && (entry & KMEM_PAGE_COW_WRITE)) {
+            return break_cow(root, &cursor);
+        }
+        // already filled in, by an earlier fault on the same page
+        if(!(code & MMAN_FAULT_PRESENT)) return 0;
+        return 1;
+    }
+    if(cursor.level != 3 || !(entry & KMEM_PAGE_RESERVED)) return 1;
+
+    if((entry & KMEM_PAGE_HUGE_HINT) && fill_huge(root, &cursor) == 0) {
+        return 0;
     }
+
+    return fill_reserved(root, kmem_cursor_entry(&cursor));
 }
 
 uint64_t mman_own_root() {
@@ -270,97 +878,226 @@ uint64_t mman_make_root() {
 }
 
 uint64_t mman_import_root(uint64_t cr3) {
-    return import_root(cr3);
+    return import_root(cr3 & ~KMEM_FLAG_MASK);
 }
 
-uint64_t mman_get_phy(uint64_t root, uint64_t address) {
-    uint64_t cr3 = (uint64_t)avl_search(&root_map, (void *)root);
-    if(cr3 == 0) return -1;
+uint64_t mman_get_phy(uint64_t root_id, uint64_t address) {
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return -1;
 
-    uint8_t ok = 0;
-    uint64_t entry = kmem_paging_addr(cr3, (address & ~0xfff), 3, &ok);
-    if(!ok) return 0;
-    return (phy_read64(entry) & ~KMEM_FLAG_MASK) | (address & 0xfff);
+    return kmem_get_phy(root->cr3, address);
 }
 
 void mman_set_pagefree_callback(void (*callback)(uint64_t address)) {
     pagefree_callback = callback;
 }
 
-void mman_increment_root(uint64_t root) {
-    uint64_t current = (uint64_t)avl_search(&root_refcount, (void *)root);
-    avl_insert(&root_refcount, (void *)root, (void *)(current + 1));
+void mman_increment_root(uint64_t root_id) {
+    mman_root_t *root = get_root(root_id);
+    if(root) root->refcount ++;
+}
+
+// address mapped by entry index of a table at level that maps base onwards
+static uint64_t entry_address(uint64_t base, int level, uint64_t index) {
+    uint64_t address = base | (index * KMEM_LEVEL_SIZE(level));
+    // canonical form
+    if(level == 0 && index >= 256) address |= 0xffff000000000000ULL;
+    return address;
 }
 
-static void remove_helper(uint64_t root, int level) {
+// entries that kmem_create_root copies into every root, pointing at the same
+// tables; they belong to no root in particular, so no root counts them
+static int shared_entry(uint64_t address, int level) {
+    if(level == 0) return address == PHY_MAP_BASE;
+    if(level != 2) return 0;
+
+    return address == TASK_BASE || address == DESC_BASE
+        || address == KMEM_BASE_ADDR || address == STATUS_BASE;
+}
+
+// frames mapped by the present entries of a leaf table; import and
+// teardown update their references a table at a time. Neither nests, so
+// one buffer does.
+static uint64_t leaf_pages[512];
+
+static uint64_t gather_leaves(uint64_t table) {
+    uint64_t count = 0;
     for(uint64_t i = 0; i < 512; i ++) {
-        // skip physical memory map
-        if(level == 0 && i == 384) continue;
+        uint64_t entry = phy_read64(table + i*8);
+        if(entry & KMEM_PAGE_PRESENT) {
+            leaf_pages[count++] = entry & ~KMEM_FLAG_MASK;
+        }
+    }
+    return count;
+}
+
+static void remove_leaves(uint64_t table) {
+    uint64_t count = gather_leaves(table);
+    uint64_t freed = kmem_frames_put(count, leaf_pages);
+
+    for(uint64_t i = 0; i < freed; i ++) {
+        if(pagefree_callback) pagefree_callback(leaf_pages[i]);
+        if(active_gather) tlb_gather_free(active_gather, leaf_pages[i]);
+    }
+    if(!active_gather) kmem_unusepages(freed, leaf_pages);
+}
 
+static void remove_helper(uint64_t table, int level, uint64_t base) {
+    if(level == 3) {
+        remove_leaves(table);
+        return;
+    }
+
+    for(uint64_t i = 0; i < 512; i ++) {
         // read entry
-        uint64_t entry = phy_read64(root + i*8);
+        uint64_t entry = phy_read64(table + i*8);
 
         // if entry not present, continue
         if((entry & 1) == 0) continue;
 
         uint64_t page = entry & ~KMEM_FLAG_MASK;
 
-        if(level < 3) remove_helper(page, level+1);
+        uint64_t address = entry_address(base, level, i);
+        if(shared_entry(address, level)) continue;
 
+        if(entry & KMEM_PAGE_LARGE) {
+            decrement_pages(page & ~(KMEM_LEVEL_SIZE(level) - 1),
+                KMEM_LEVEL_SIZE(level) / 0x1000);
+            continue;
+        }
+
+        remove_helper(page, level+1, address);
         decrement_page(page);
     }
 }
 
-void mman_decrement_root(uint64_t root) {
-    uint64_t current = (uint64_t)avl_search(&root_refcount, (void *)root);
+void mman_decrement_root(uint64_t root_id) {
+    mman_root_t *root = get_root(root_id);
 
-    if(current == 0) return;
-    else if(current > 1) {
-        avl_insert(&root_refcount, (void *)root, (void *)(current - 1));
-    }
+    if(root == 0 || root->refcount == 0) return;
+    else if(root->refcount > 1) root->refcount --;
     else {
-        avl_remove(&root_refcount, (void *)root);
-        uint64_t cr3 = (uint64_t)avl_remove(&root_map, (void *)root);
-        remove_helper(cr3, 0);
+        avl64_remove(&root_map, &root->id_node);
+        avl64_remove(&cr3_map, &root->cr3_node);
+        release_pcid(root);
+        remove_helper(root->cr3, 0, 0);
 
-        decrement_page(cr3);
+        decrement_page(root->cr3);
+        heap_free(root);
     }
 }
 
-int mman_is_root(uint64_t root) {
-    return !!avl_search(&root_map, (void *)root);
+int mman_is_root(uint64_t root_id) {
+    return !!get_root(root_id);
 }
 
-uint64_t mman_get_root_cr3(uint64_t root) {
-    return (uint64_t)avl_search(&root_map, (void *)root);
+uint64_t mman_get_root_cr3(uint64_t root_id) {
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return 0;
+    return root->cr3;
 }
 
-static void import_helper(uint64_t root, int level) {
-    for(uint64_t i = 0; i < 512; i ++) {
-        // skip physical memory map
-        if(level == 0 && i == 384) continue;
+uint64_t mman_get_root_task_cr3(uint64_t root_id) {
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return 0;
+    if(root->pcid == 0) return root->cr3;
 
+    return root->cr3 | root->pcid | KMEM_CR3_NOFLUSH;
+}
+
+uint64_t mman_root_table_pages(uint64_t root_id) {
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return 0;
+    return root->table_pages;
+}
+
+uint64_t mman_root_resident(uint64_t root_id) {
+    mman_root_t *root = get_root(root_id);
+    if(root == 0) return 0;
+    return root->resident;
+}
+
+uint64_t mman_table_pages(void) {
+    uint64_t total = 0;
+    avl64_node_t *node = avl64_first(&root_map);
+    for(; node; node = avl64_next(node)) {
+        total += AVL64_ENTRY(node, mman_root_t, id_node)->table_pages;
+    }
+    return total;
+}
+
+uint64_t mman_list_roots(uint64_t *ids, uint64_t max) {
+    uint64_t count = 0;
+    // in ascending ID order
+    avl64_node_t *node = avl64_first(&root_map);
+    for(; node; node = avl64_next(node)) {
+        if(count < max) ids[count] = node->key;
+        count ++;
+    }
+    return count;
+}
+
+uint64_t mman_tables_reclaimed(void) {
+    return tables_reclaimed;
+}
+
+static void import_helper(mman_root_t *root, uint64_t table, int level,
+    uint64_t base) {
+
+    if(level == 3) {
+        uint64_t count = gather_leaves(table);
+        kmem_frames_get(count, leaf_pages);
+        root->resident += count;
+        return;
+    }
+
+    for(uint64_t i = 0; i < 512; i ++) {
         // read entry
-        uint64_t entry = phy_read64(root + i*8);
+        uint64_t entry = phy_read64(table + i*8);
 
         // if entry not present, continue
         if((entry & 1) == 0) continue;
 
         uint64_t page = entry & ~KMEM_FLAG_MASK;
-        increment_page(page);
 
-        if(level < 3) import_helper(page, level+1);
+        uint64_t address = entry_address(base, level, i);
+        if(shared_entry(address, level)) continue;
+
+        if(entry & KMEM_PAGE_LARGE) {
+            increment_pages(page & ~(KMEM_LEVEL_SIZE(level) - 1),
+                KMEM_LEVEL_SIZE(level) / 0x1000);
+            root->resident += KMEM_LEVEL_SIZE(level) / 0x1000;
+            continue;
+        }
+
+        increment_page(page);
+        claim_pages(page, 1, root, KMEM_FRAME_TABLE);
+        root->table_pages ++;
+        import_helper(root, page, level+1, address);
     }
 }
 
-static uint64_t import_root(uint64_t root) {
+static uint64_t import_root(uint64_t cr3) {
+    mman_root_t *root = heap_alloc(sizeof(*root));
+    root->cr3 = cr3;
+    root->refcount = 0;
+    root->table_pages = 1;
+    root->resident = 0;
+    assign_pcid(root);
+
+    uint64_t id = gen_id();
+    root->id = id;
+
     // root page is in use
-    increment_page(root);
+    increment_page(cr3);
+    claim_pages(cr3, 1, root, KMEM_FRAME_TABLE);
     // mark everything else as in use
-    import_helper(root, 0);
+    import_helper(root, cr3, 0, 0);
 
-    uint64_t id = gen_id();
-    avl_insert(&root_map, (void *)id, (void *)root);
+    root->id_node.key = id;
+    avl64_insert(&root_map, &root->id_node);
+    root->cr3_node.key = cr3;
+    avl64_insert(&cr3_map, &root->cr3_node);
 
     return id;
 }
@@ -3,18 +3,34 @@
 
 #include <stdint.h>
 
+// mman_anonymous flags
+#define MMAN_MAP_HUGE 0x01 // back aligned 2MB stretches with 2MB frames
+#define MMAN_MAP_RESERVE 0x02 // fill pages in on first touch
+#define MMAN_MAP_GUARD 0x04 // keep the lowest page as a guard page
+
+// mman_mirror flags
+#define MMAN_MIRROR_COW 0x01 // share until written to, then copy
+
+// mman_fault codes, as pushed by the CPU for a page fault
+#define MMAN_FAULT_PRESENT 0x01
+#define MMAN_FAULT_WRITE 0x02
+
 void mman_init(uint64_t bootproc_cr3);
 
-int mman_anonymous(uint64_t root_id, uint64_t address, uint64_t size);
+int mman_anonymous(uint64_t root_id, uint64_t address, uint64_t size,
+    uint64_t flags);
 int mman_physical(uint64_t root_id, uint64_t address, uint64_t paddress,
     uint64_t size);
+int mman_dma(uint64_t root_id, uint64_t address, uint64_t size,
+    uint64_t *paddress);
 int mman_check_all_mapped(uint64_t root_id, uint64_t address, uint64_t size);
 int mman_check_any_mapped(uint64_t root_id, uint64_t address, uint64_t size);
 int mman_mirror(uint64_t root_id, uint64_t address, uint64_t sroot_id,
-    uint64_t saddress, uint64_t size);
+    uint64_t saddress, uint64_t size, uint64_t flags);
 int mman_unmap(uint64_t root_id, uint64_t address, uint64_t size);
 int mman_protect(uint64_t root_id, uint64_t address, uint64_t size,
     uint64_t flags);
+int mman_fault(uint64_t cr3, uint64_t address, uint64_t code);
 
 uint64_t mman_own_root(void);
 uint64_t mman_make_root(void);
@@ -28,5 +44,11 @@ void mman_increment_root(uint64_t root);
 void mman_decrement_root(uint64_t root);
 int mman_is_root(uint64_t root);
 uint64_t mman_get_root_cr3(uint64_t root);
+uint64_t mman_get_root_task_cr3(uint64_t root);
+uint64_t mman_root_table_pages(uint64_t root);
+uint64_t mman_root_resident(uint64_t root);
+uint64_t mman_list_roots(uint64_t *ids, uint64_t max);
+uint64_t mman_table_pages(void);
+uint64_t mman_tables_reclaimed(void);
 
 #endif
@@ -13,6 +13,8 @@
 #include "task.h"
 #include "listen.h"
 #include "synch.h"
+#include "tlb.h"
+#include "selftest.h"
 
 static task_state_t *choose_next(task_state_t *current) {
     int64_t init = current - TASK_MEM(0);
@@ -52,6 +54,7 @@ static void change_task(uint64_t vector,
     }
 
     lapic_conditional_eoi(vector);
+    tlb_switch(ret_task->cr3);
     transfer(0, ret_task);
 }
 
@@ -67,6 +70,27 @@ static void process_queue(uint64_t __attribute__((unused)) vector,
     }
 
     void (*transfer)(uint64_t, task_state_t *) = (void *)0xffffffffffe00000;
+    tlb_switch(ret_task->cr3);
+    transfer(0, ret_task);
+}
+
+char fault_stack[4096];
+static void page_fault(uint64_t __attribute__((unused)) vector,
+    uint64_t excode, task_state_t *ret_task) {
+
+    uint64_t address;
+    __asm__ __volatile__("mov %%cr2, %%rax" : "=a"(address));
+
+    ret_task->faults ++;
+
+    if(mman_fault(ret_task->cr3, address, excode) != 0) {
+        d_printf("unhandled page fault at 0x%x (code %x)\n", address, excode);
+        ret_task->state &= ~TASK_STATE_RUNNABLE;
+        ret_task = choose_next(ret_task);
+    }
+
+    void (*transfer)(uint64_t, task_state_t *) = (void *)0xffffffffffe00000;
+    tlb_switch(ret_task->cr3);
     transfer(0, ret_task);
 }
 
@@ -77,18 +101,33 @@ void _start(uint64_t bootproc_cr3, task_state_t *hw_task) {
 
     // init local components
     mman_init(bootproc_cr3);
+    // the heap's pages are counted from here on
+    static uint64_t heap_owner;
+    heap_owner = mman_own_root();
+    heap_set_sizer(heap_klib_sizer, &heap_owner);
     task_init();
     synch_init();
+    tlb_init();
+#ifndef NDEBUG
+    selftest_run();
+#endif
 
     task_state_t *tick_ts = task_create();
     task_set_local(tick_ts, change_task, change_stack + 1024);
+    tick_ts->cr3 = mman_get_root_task_cr3(mman_own_root());
 
     DESC_INT_TASKS_MEM[0xff] = (uint64_t)tick_ts;
 
     task_state_t *process_ts = task_create();
     task_set_local(process_ts, process_queue, process_stack + 4096);
+    process_ts->cr3 = mman_get_root_task_cr3(mman_own_root());
     DESC_INT_TASKS_MEM[0xfe] = (uint64_t)process_ts;
 
+    task_state_t *fault_ts = task_create();
+    task_set_local(fault_ts, page_fault, fault_stack + 4096);
+    fault_ts->cr3 = mman_get_root_task_cr3(mman_own_root());
+    DESC_INT_TASKS_MEM[14] = (uint64_t)fault_ts;
+
     // the scheduler uses task #1.
     TASK_MEM(1)->state = TASK_STATE_VALID | TASK_STATE_RUNNABLE;
 
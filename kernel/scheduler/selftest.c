@@ -0,0 +1,62 @@
+#include "klib/d.h"
+#include "klib/kmem.h"
+
+#include "mman.h"
+#include "selftest.h"
+
+// somewhere no fresh root maps anything
+#define SELFTEST_ADDRESS 0x40000000
+
+static int failures;
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            d_printf("selftest: %s failed (line %d)\n", #cond, __LINE__); \
+            failures ++; \
+        } \
+    } while(0)
+
+static uint64_t leaf_entry(uint64_t root_id, uint64_t address) {
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, mman_get_root_cr3(root_id), address);
+    if(cursor.level != 3) return 0;
+    return kmem_cursor_get(&cursor);
+}
+
+// reserved pages protected before their first touch must come in with the
+// new protection
+static void test_protect_reserved(void) {
+    uint64_t root_id = mman_make_root();
+    mman_increment_root(root_id);
+
+    uint64_t address = SELFTEST_ADDRESS;
+    CHECK(mman_anonymous(root_id, address, 0x4000, MMAN_MAP_RESERVE) == 0);
+    CHECK(mman_protect(root_id, address, 0x4000, KMEM_MAP_RO_DATA) == 0);
+
+    uint64_t untouched = leaf_entry(root_id, address);
+    CHECK(untouched & KMEM_PAGE_RESERVED);
+    CHECK(!(untouched & KMEM_PAGE_PRESENT));
+    CHECK(!(untouched & KMEM_PAGE_WRITE));
+
+    uint64_t cr3 = mman_get_root_cr3(root_id);
+    CHECK(mman_fault(cr3, address + 0x1000, 0) == 0);
+
+    uint64_t entry = leaf_entry(root_id, address + 0x1000);
+    CHECK(entry & KMEM_PAGE_PRESENT);
+    CHECK(!(entry & KMEM_PAGE_RESERVED));
+    CHECK(!(entry & KMEM_PAGE_WRITE));
+    CHECK(entry & (1ULL<<63));
+
+    // writing is still refused
+    CHECK(mman_fault(cr3, address + 0x1000,
+        MMAN_FAULT_PRESENT | MMAN_FAULT_WRITE) != 0);
+
+    mman_decrement_root(root_id);
+}
+
+int selftest_run(void) {
+    failures = 0;
+    test_protect_reserved();
+    if(failures) d_printf("selftest: %d checks failed\n", failures);
+    return failures;
+}
@@ -0,0 +1,8 @@
+#ifndef SCHEDULER_SELFTEST_H
+#define SCHEDULER_SELFTEST_H
+
+// boot-time checks of the scheduler's memory management, run in debug
+// builds; returns the number of failed checks
+int selftest_run(void);
+
+#endif
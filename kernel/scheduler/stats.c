@@ -0,0 +1,101 @@
+#include "clib/slab.h"
+
+#include "klib/kmem.h"
+#include "klib/heap.h"
+#include "klib/phy.h"
+#include "klib/task.h"
+
+#include "kernel/status.h"
+
+#include "mman.h"
+#include "task.h"
+#include "stats.h"
+
+// where the scheduler sees the status page writable
+#define STATUS_WRITE_ADDRESS 0x50100000
+#define STATUS_WRITE ((volatile kernel_status_t *)STATUS_WRITE_ADDRESS)
+
+// offset in task-local storage of the address of the rlib heap size
+#define TLS_HEAP_SIZE 0x408
+
+static uint64_t hw_id;
+
+void stats_init(uint64_t hw_task_id) {
+    hw_id = hw_task_id;
+
+    // everyone else gets the same page read-only
+    uint64_t page = kmem_get_phy(kmem_current(), STATUS_BASE);
+    mman_physical(mman_own_root(), STATUS_WRITE_ADDRESS, page, 0x1000);
+
+    stats_update();
+}
+
+// heap size of an rlib process, which its main task points at from its
+// task-local storage; every thread of the process grows the same heap
+static uint64_t task_heap(uint64_t task_id) {
+    task_info_t *info = sched_get_info(task_id);
+    if(!info) return 0;
+
+    uint64_t phy = mman_get_phy(info->root_id,
+        info->state->gs_base + TLS_HEAP_SIZE);
+    if(phy == 0 || phy == (uint64_t)-1) return 0;
+
+    uint64_t address = phy_read64(phy);
+    if(address == 0 || (address & 7)) return 0;
+    phy = mman_get_phy(info->root_id, address);
+    if(phy == 0 || phy == (uint64_t)-1) return 0;
+    return phy_read64(phy);
+}
+
+void stats_update(void) {
+    volatile kernel_status_t *status = STATUS_WRITE;
+
+    kmem_stats_t kstats;
+    kmem_get_stats(&kstats);
+
+    uint64_t ids[STATUS_MAX_ROOTS];
+    uint64_t root_count = mman_list_roots(ids, STATUS_MAX_ROOTS);
+
+    status->sequence ++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    status->total_frames = kstats.total;
+    status->free_frames = kstats.free;
+    status->used_frames = kstats.total - kstats.free;
+    status->zeroed_frames = kstats.zeroed;
+    status->dma_free_frames = kstats.zone_free[KMEM_ZONE_DMA32];
+    status->node_count = kstats.node_count;
+    for(uint64_t n = 0; n < STATUS_MAX_NODES && n < KMEM_MAX_NODES; n ++) {
+        status->node_free_frames[n] = kstats.node_free[n];
+    }
+
+    status->scheduler_heap = heap_klib_size();
+    status->hw_heap = task_heap(hw_id);
+
+    status->root_count = root_count;
+    for(uint64_t i = 0; i < root_count && i < STATUS_MAX_ROOTS; i ++) {
+        status->roots[i].root_id = ids[i];
+        status->roots[i].resident_pages = mman_root_resident(ids[i]);
+        status->roots[i].table_pages = mman_root_table_pages(ids[i]);
+    }
+    uint64_t slab_count = 0;
+    for(slab_cache_t *c = slab_caches(); c; c = c->next, slab_count ++) {
+        if(slab_count >= STATUS_MAX_SLABS) continue;
+
+        volatile kernel_status_slab_t *slab = status->slabs + slab_count;
+        uint64_t i = 0;
+        for(; c->name[i] && i + 1 < sizeof(slab->name); i ++) {
+            slab->name[i] = c->name[i];
+        }
+        slab->name[i] = 0;
+        slab->object_size = c->size;
+        slab->active = c->active;
+        slab->total = c->total;
+    }
+    status->slab_count = slab_count;
+    status->table_pages = mman_table_pages();
+    status->tables_reclaimed = mman_tables_reclaimed();
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    status->sequence ++;
+}
@@ -0,0 +1,9 @@
+#ifndef SCHEDULER_STATS_H
+#define SCHEDULER_STATS_H
+
+#include <stdint.h>
+
+void stats_init(uint64_t hw_task_id);
+void stats_update(void);
+
+#endif
@@ -1,5 +1,6 @@
-#include "clib/avl.h"
-#include "clib/heap.h"
+#include "clib/avl64.h"
+#include "clib/radix.h"
+#include "clib/slab.h"
 
 #include "klib/d.h"
 #include "klib/task.h"
@@ -9,19 +10,22 @@
 #include "task.h"
 #include "mman.h"
 
-typedef struct page_object_t {
-    struct page_object_t *next;
-    synchobj_t *object;
-} page_object_t;
+// ordered by address, so the objects of a page are adjacent
+avl64_tree_t synch_objects;
+// map from page frame number to the lowest-addressed object in the page;
+// pages without objects cost a few loads to rule out
+radix_tree_t synch_pages;
 
-avl_tree_t synch_objects;
-avl_tree_t synch_pages;
+static slab_cache_t object_cache =
+    SLAB_CACHE_INIT("synchobj_t", sizeof(synchobj_t), 0);
+static slab_cache_t wait_cache =
+    SLAB_CACHE_INIT("synch_wait_t", sizeof(synch_wait_t), 0);
 
 static void free_objects(uint64_t page_addr);
 
 void synch_init() {
-    avl_initialize(&synch_objects, avl_ptrcmp, heap_free);
-    avl_initialize(&synch_pages, avl_ptrcmp, 0);
+    avl64_initialize(&synch_objects);
+    radix_init(&synch_pages);
 
     mman_set_pagefree_callback(free_objects);
 }
@@ -33,16 +37,22 @@ synchobj_t *synch_make(uint64_t phy) {
     uint64_t over = (phy & 0xfff) + 8;
     if(over < 8) return 0;
 
-    synchobj_t *ret = heap_alloc(sizeof(*ret));
+    synchobj_t *ret = slab_alloc(&object_cache);
+    if(!ret) return 0;
 
     ret->phy_addr = phy;
     ret->head = 0;
 
-    avl_insert(&synch_objects, (void *)phy, ret);
+    synchobj_t *first = radix_get(&synch_pages, phy >> 12);
+    if(!first || phy < first->phy_addr) {
+        if(radix_set(&synch_pages, phy >> 12, ret)) {
+            slab_free(&object_cache, ret);
+            return 0;
+        }
+    }
 
-    page_object_t *pobj = heap_alloc(sizeof(*pobj));
-    pobj->object = ret;
-    pobj->next = avl_insert(&synch_pages, (void *)(phy & ~0xfff), pobj);
+    ret->node.key = phy;
+    avl64_insert(&synch_objects, &ret->node);
 
     return ret;
 }
@@ -52,56 +62,55 @@ void synch_destroy(synchobj_t *object) {
     while(1) {
         if(!w) break;
 
+        // waiters may have been reaped since
         task_info_t *info = sched_get_info(w->task_id);
-        info->state->state &= ~TASK_STATE_BLOCKED;
+        if(info) info->state->state &= ~TASK_STATE_BLOCKED;
 
-        w = w->next;
         synch_wait_t *t = w;
-        heap_free(t);
+        w = w->next;
+        slab_free(&wait_cache, t);
     }
 
-    page_object_t *pobj = avl_search(&synch_pages, (void *)(object->phy_addr & ~0xfff));
-    // head case
-    if(pobj->object == object) {
-        avl_insert(&synch_pages, (void *)(object->phy_addr & ~0xfff), pobj->next);
-        heap_free(pobj);
-    }
-    else while(1) {
-        if(!pobj) break;
-        if(!pobj->next) break;
-        page_object_t *n = pobj->next;
-
-        if(n->object == object) {
-            pobj->next = n->next;
-            heap_free(n);
-            break;
+    // the next object takes over the page if this one was its first
+    uint64_t page = object->phy_addr >> 12;
+    if(radix_get(&synch_pages, page) == object) {
+        avl64_node_t *next = avl64_next(&object->node);
+        if(next && (next->key >> 12) == page) {
+            radix_set(&synch_pages, page,
+                AVL64_ENTRY(next, synchobj_t, node));
         }
-        else pobj = n;
+        else radix_set(&synch_pages, page, 0);
     }
 
-    heap_free(object);
+    avl64_remove(&synch_objects, &object->node);
+    slab_free(&object_cache, object);
 }
 
 static void free_objects(uint64_t page_addr) {
-    page_object_t *pobj;
-    while((pobj = avl_search(&synch_pages, (void *)page_addr))) {
-        synch_destroy(pobj->object);
+    synchobj_t *object;
+    while((object = radix_get(&synch_pages, page_addr >> 12))) {
+        synch_destroy(object);
     }
 }
 
 synchobj_t *synch_from_phy(uint64_t phy) {
-    synchobj_t *result = avl_search(&synch_objects, (void *)phy);
-    return result;
+    if(!radix_get(&synch_pages, phy >> 12)) return 0;
+
+    avl64_node_t *node = avl64_search(&synch_objects, phy);
+    return node ? AVL64_ENTRY(node, synchobj_t, node) : 0;
 }
 
 int synch_wait(uint64_t task_id, synchobj_t *object, uint64_t value) {
+    task_info_t *info = sched_get_info(task_id);
+    if(!info) return 1;
+
     if(phy_read64(object->phy_addr) == value) {
-        synch_wait_t *wait = heap_alloc(sizeof(*wait));
+        synch_wait_t *wait = slab_alloc(&wait_cache);
         wait->task_id = task_id;
         wait->next = object->head;
         object->head = wait;
 
-        sched_get_info(task_id)->state->state |= TASK_STATE_BLOCKED;
+        info->state->state |= TASK_STATE_BLOCKED;
         return 0;
     }
     else return 1;
@@ -110,15 +119,19 @@ int synch_wait(uint64_t task_id, synchobj_t *object, uint64_t value) {
 void synch_wake(synchobj_t *object, uint64_t value, uint64_t count) {
     if(phy_read64(object->phy_addr) == value) {
         synch_wait_t *w = object->head;
-        for(uint64_t i = 0; i < count; i ++) {
-            if(!w) break;
-
+        uint64_t woken = 0;
+        while(w && woken < count) {
+            // waiters reaped since are dropped without using up a wakeup
             task_info_t *info = sched_get_info(w->task_id);
-            info->state->state &= ~TASK_STATE_BLOCKED;
+            if(info) {
+                info->state->state &= ~TASK_STATE_BLOCKED;
+                woken ++;
+            }
 
-            w = w->next;
             synch_wait_t *t = w;
-            heap_free(t);
+            w = w->next;
+            slab_free(&wait_cache, t);
         }
+        object->head = w;
     }
 }
@@ -3,12 +3,15 @@
 
 #include <stdint.h>
 
+#include "clib/avl64.h"
+
 typedef struct synch_wait_t {
     struct synch_wait_t *next;
     uint64_t task_id;
 } synch_wait_t;
 
 typedef struct synchobj_t {
+    avl64_node_t node; // in synch_objects, keyed by phy_addr
     uint64_t phy_addr;
     synch_wait_t *head;
 } synchobj_t;
@@ -7,7 +7,6 @@
 #include "klib/task.h"
 #include "klib/d.h"
 
-#include "id.h"
 #include "task.h"
 #include "mman.h"
 
@@ -21,14 +20,55 @@
 
 #define TEMPORARY_MAP_ADDRESS 0x50000000
 
-avl_tree_t task_map; // map from task ID to task_info_t *
+_Static_assert(TASK_MAX_SLOTS == NUM_TASKS, "one task slot per task state");
+
+typedef struct {
+    task_info_t *info;
+    // part of the IDs handed out for this slot; bumped on release
+    uint64_t generation;
+    // 1 + the next free slot, or 0
+    uint64_t next_free;
+} task_slot_t;
+
+// map from task ID to task_info_t *
+static task_slot_t task_slots[TASK_MAX_SLOTS];
+// slots handed out at least once; the rest have never been touched
+static uint64_t slots_used;
+// 1 + the most recently released slot, or 0
+static uint64_t free_slots;
+
 avl_tree_t named_tasks; // map from strings to task IDs
 
 void task_init() {
-    avl_initialize(&task_map, avl_ptrcmp, 0);
     avl_initialize(&named_tasks, (avl_comparator_t)str_cmp, heap_free);
 }
 
+// returns -1 once every slot is taken
+static uint64_t alloc_id(task_info_t *info) {
+    uint64_t slot;
+    if(free_slots) {
+        slot = free_slots - 1;
+        free_slots = task_slots[slot].next_free;
+    }
+    else if(slots_used < TASK_MAX_SLOTS) slot = slots_used ++;
+    else return -1;
+
+    task_slot_t *s = task_slots + slot;
+    // generation 0 is skipped so that no task ID is 0
+    if(s->generation == 0) s->generation = 1;
+    s->info = info;
+
+    return (s->generation << TASK_SLOT_BITS) | slot;
+}
+
+static void release_id(uint64_t task_id) {
+    task_slot_t *s = task_slots + TASK_ID_SLOT(task_id);
+    s->info = 0;
+    s->generation ++;
+    s->next_free = free_slots;
+    free_slots = TASK_ID_SLOT(task_id) + 1;
+}
+
 static uint64_t find_available_local() {
     for(uint64_t i = 0; i < LOCAL_CHANNEL_SIZE / CHANNEL_SIZE; i ++) {
         uint64_t addr = LOCAL_CHANNEL_BASE + i * LOCAL_CHANNEL_SIZE;
@@ -46,8 +86,9 @@ static uint64_t add_channel(uint64_t root_id, uint64_t *addr) {
         uint64_t caddr = TASK_CHANNEL_START + i*CHANNEL_SIZE;
         if(mman_check_any_mapped(root_id, caddr, CHANNEL_SIZE)) continue;
 
-        mman_anonymous(root_id, caddr, CHANNEL_SIZE);
-        mman_mirror(mman_own_root(), local_addr, root_id, caddr, CHANNEL_SIZE);
+        mman_anonymous(root_id, caddr, CHANNEL_SIZE, 0);
+        mman_mirror(mman_own_root(), local_addr, root_id, caddr, CHANNEL_SIZE,
+            0);
 
         *addr = caddr;
 
@@ -62,7 +103,7 @@ static uint64_t add_storage(uint64_t root_id) {
         uint64_t saddr = LOCAL_STORAGE_BASE + i * LOCAL_STORAGE_SIZE;
         if(mman_check_any_mapped(root_id, saddr, LOCAL_STORAGE_SIZE)) continue;
 
-        mman_anonymous(root_id, saddr, LOCAL_STORAGE_SIZE);
+        mman_anonymous(root_id, saddr, LOCAL_STORAGE_SIZE, 0);
 
         return saddr;
     }
@@ -76,7 +117,7 @@ static void task_setup(task_state_t *ts, task_info_t *info) {
     // point GS towards task-local storage
     ts->gs_base = add_storage(info->root_id);
     mman_mirror(mman_own_root(), TEMPORARY_MAP_ADDRESS, info->root_id,
-        ts->gs_base, 0x1000);
+        ts->gs_base, 0x1000, 0);
 
     uint64_t *tls = (void *)TEMPORARY_MAP_ADDRESS;
     tls[0] = info->id;
@@ -108,12 +149,13 @@ static void task_setup(task_state_t *ts, task_info_t *info) {
 }
 
 uint64_t sched_task_attach(task_state_t *ts, task_info_t *info) {
-    uint64_t id = gen_id();
+    uint64_t id = alloc_id(info);
+    if(id == (uint64_t)-1) return -1;
     info->id = id;
-    avl_insert(&task_map, (void *)id, info);
-    
+
     uint64_t root_id = mman_import_root(ts->cr3);
     mman_increment_root(root_id);
+    ts->cr3 = mman_get_root_task_cr3(root_id);
 
     info->state = ts;
     info->root_id = root_id;
@@ -137,16 +179,16 @@ uint64_t sched_named_task(const char *name) {
 uint64_t sched_task_create(uint64_t root_id, task_info_t *info) {
     if(!mman_is_root(root_id)) return -1;
 
+    uint64_t id = alloc_id(info);
+    if(id == (uint64_t)-1) return -1;
+    info->id = id;
+
     task_state_t *ts = task_create();
 
     info->state = ts;
 
-    uint64_t id = gen_id();
-    info->id = id;
-    avl_insert(&task_map, (void *)id, info);
-
     mman_increment_root(root_id);
-    ts->cr3 = mman_get_root_cr3(root_id);
+    ts->cr3 = mman_get_root_task_cr3(root_id);
     info->root_id = root_id;
 
     task_setup(ts, info);
@@ -155,10 +197,10 @@ uint64_t sched_task_create(uint64_t root_id, task_info_t *info) {
 }
 
 task_info_t *sched_task_reap(uint64_t task_id) {
-    task_info_t *info = avl_search(&task_map, (void *)task_id);
+    task_info_t *info = sched_get_info(task_id);
     if(!info) return 0;
 
-    mman_decrement_root(info->state->cr3);
+    mman_decrement_root(info->root_id);
     info->state->state = 0;
     info->state->cr3 = 0;
 
@@ -166,13 +208,13 @@ task_info_t *sched_task_reap(uint64_t task_id) {
         mman_unmap(mman_own_root(), (uint64_t)info->gin, CHANNEL_SIZE);
     }
 
-    avl_remove(&task_map, (void *)task_id);
+    release_id(task_id);
 
     return info;
 }
 
 void sched_set_state(uint64_t task_id, uint64_t index, uint64_t value) {
-    task_info_t *info = avl_search(&task_map, (void *)task_id);
+    task_info_t *info = sched_get_info(task_id);
 
     if(info && index < 32) {
         uint64_t *indexed = (void *)info->state;
@@ -181,5 +223,9 @@ void sched_set_state(uint64_t task_id, uint64_t index, uint64_t value) {
 }
 
 task_info_t *sched_get_info(uint64_t task_id) {
-    return avl_search(&task_map, (void *)task_id);
+    task_slot_t *s = task_slots + TASK_ID_SLOT(task_id);
+    if(s->info == 0) return 0;
+    if((task_id >> TASK_SLOT_BITS) != s->generation) return 0;
+
+    return s->info;
 }
@@ -7,6 +7,13 @@
 
 typedef struct synchobj_t synchobj_t;
 
+// task IDs are handles: the low bits pick a slot in the task table, the
+// rest count how often that slot has been reused, so that IDs of reaped
+// tasks resolve to nothing. There is a slot for every task state (NUM_TASKS)
+#define TASK_SLOT_BITS 12
+#define TASK_MAX_SLOTS (1 << TASK_SLOT_BITS)
+#define TASK_ID_SLOT(id) ((id) & (TASK_MAX_SLOTS - 1))
+
 typedef struct task_info_t {
     uint64_t id;
     task_state_t *state;
@@ -0,0 +1,247 @@
+#include "klib/d.h"
+#include "klib/desc.h"
+#include "klib/kmem.h"
+#include "klib/lapic.h"
+#include "klib/task.h"
+
+#include "mman.h"
+#include "tlb.h"
+
+_Static_assert(TASK_PCID_CPUS == KMEM_MAX_CPUS,
+    "one PCID bitmap per CPU");
+
+// untagged address space each CPU last switched into
+static uint64_t cpu_roots[KMEM_MAX_CPUS];
+// CPUs that have yet to take a shootdown interrupt
+static volatile uint64_t pending;
+// the gather the shootdown interrupt is answering
+static tlb_gather_t *volatile request;
+// set while the PCID of request is being taken away from its owner
+static volatile int recycling;
+static int has_invpcid;
+
+static void invpcid(uint64_t type, uint64_t pcid, uint64_t address) {
+    struct { uint64_t pcid, address; } descriptor = { pcid, address };
+    __asm__ __volatile__("invpcid %0, %1"
+        : : "m"(descriptor), "r"(type) : "memory");
+}
+
+static void flush_local(tlb_gather_t *gather) {
+    if(gather->count > TLB_FLUSH_THRESHOLD) {
+        // reloading CR3 as read (no-flush bit clear) flushes its PCID
+        __asm__ __volatile__(
+            "mov %%cr3, %%rax \n"
+            "mov %%rax, %%cr3"
+            : : : "rax", "memory");
+        return;
+    }
+
+    for(uint64_t i = 0; i < gather->count; i ++) {
+        __asm__ __volatile__("invlpg (%%rax)"
+            : : "a"(gather->addresses[i]) : "memory");
+    }
+}
+
+// drops this CPU's translations for the gather, leaving other PCIDs alone
+static void invalidate(tlb_gather_t *gather, uint64_t cpu) {
+    uint64_t cr3 = gather->cr3 & ~KMEM_FLAG_MASK;
+    uint64_t pcid = gather->cr3 & KMEM_CR3_PCID_MASK;
+    uint64_t current;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(current));
+
+    // invlpg only reaches the PCID that is loaded
+    if((current & ~KMEM_FLAG_MASK) == cr3) {
+        flush_local(gather);
+        if((current & KMEM_CR3_PCID_MASK) == pcid) return;
+    }
+    // untagged address spaces get a fresh TLB whenever they are loaded
+    if(pcid == 0) return;
+
+    if(has_invpcid && gather->count > TLB_FLUSH_THRESHOLD) {
+        // single-context invalidation
+        invpcid(1, pcid, 0);
+        return;
+    }
+    if(has_invpcid) {
+        // individual-address invalidation
+        for(uint64_t i = 0; i < gather->count; i ++) {
+            invpcid(0, pcid, gather->addresses[i]);
+        }
+        return;
+    }
+
+    // no way to reach the PCID from here, so flush it on its next load;
+    // CPUs without a bitmap flush on every load anyway
+    if(cpu < KMEM_MAX_CPUS) {
+        __atomic_or_fetch(TASK_PCID_FLUSH(cpu) + pcid / 64,
+            1ULL << (pcid % 64), __ATOMIC_SEQ_CST);
+    }
+}
+
+static char shootdown_stack[1024];
+static void shootdown(uint64_t __attribute__((unused)) vector,
+    uint64_t __attribute__((unused)) excode, task_state_t *ret_task) {
+
+    void (*transfer)(uint64_t, task_state_t *) = (void *)0xffffffffffe00000;
+
+    uint64_t cpu = lapic_cached_id();
+    invalidate(request, cpu);
+
+    // the task interrupted here may still run under the recycled PCID: its
+    // state was saved with the old tag, so move it to the untagged root
+    // that retag_tasks gave its owner
+    uint64_t pcid = request->cr3 & KMEM_CR3_PCID_MASK;
+    if(recycling && (ret_task->cr3 & KMEM_CR3_PCID_MASK) == pcid) {
+        ret_task->cr3 &= ~(KMEM_CR3_PCID_MASK | KMEM_CR3_NOFLUSH);
+        if(cpu < KMEM_MAX_CPUS) cpu_roots[cpu] = ret_task->cr3;
+    }
+
+    __atomic_and_fetch(&pending, ~(1ULL << cpu), __ATOMIC_SEQ_CST);
+
+    lapic_send_eoi();
+    transfer(0, ret_task);
+}
+
+void tlb_init() {
+    // needed for sending interrupts to other processors
+    lapic_setup();
+
+    uint32_t eax = 7, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid"
+        : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    has_invpcid = kmem_pcid_enabled() && (ebx & (1<<10));
+
+    task_state_t *shootdown_ts = task_create();
+    task_set_local(shootdown_ts, shootdown, shootdown_stack + 1024);
+    shootdown_ts->cr3 = mman_get_root_task_cr3(mman_own_root());
+    DESC_INT_TASKS_MEM[TLB_SHOOTDOWN_VECTOR] = (uint64_t)shootdown_ts;
+}
+
+// records the address space this CPU is about to run; tagged ones are
+// tracked per PCID by transfer_control instead
+void tlb_switch(uint64_t cr3) {
+    uint64_t cpu = lapic_cached_id();
+    if(cpu >= KMEM_MAX_CPUS) return;
+    cpu_roots[cpu] = (cr3 & KMEM_CR3_PCID_MASK) ? 0 : cr3 & ~KMEM_FLAG_MASK;
+}
+
+void tlb_gather_begin(tlb_gather_t *gather, uint64_t cr3) {
+    gather->cr3 = cr3;
+    gather->count = 0;
+    gather->free_count = 0;
+}
+
+void tlb_gather_add(tlb_gather_t *gather, uint64_t address) {
+    // past the threshold only the count matters
+    if(gather->count < TLB_FLUSH_THRESHOLD) {
+        gather->addresses[gather->count] = address;
+    }
+    gather->count ++;
+}
+
+void tlb_gather_free(tlb_gather_t *gather, uint64_t page) {
+    if(gather->free_count == TLB_GATHER_FREES) tlb_gather_flush(gather);
+    gather->frees[gather->free_count++] = page;
+}
+
+static void send_shootdowns(uint64_t targets) {
+    for(uint64_t cpu = 0; cpu < KMEM_MAX_CPUS; cpu ++) {
+        if(!(targets & (1ULL << cpu))) continue;
+        lapic_send_ipi(cpu, TLB_SHOOTDOWN_VECTOR);
+    }
+}
+
+// the frames held back can't be released until every target has answered;
+// processors that don't are sent the interrupt once more, and if they still
+// don't answer, the scheduler stops rather than hand out frames they may
+// still reach
+static void wait_shootdowns(uint64_t targets) {
+    for(int attempt = 0; attempt < 2; attempt ++) {
+        for(uint64_t spin = 0; spin < TLB_SHOOTDOWN_SPINS; spin ++) {
+            if(!(pending & targets)) return;
+            __asm__ __volatile__("pause");
+        }
+
+        if(attempt == 0) send_shootdowns(pending & targets);
+    }
+
+    d_printf("tlb: processors %x never answered a shootdown\n",
+        pending & targets);
+    while(1) __asm__ __volatile__("cli; hlt");
+}
+
+// has the targets answer the gather, and waits until they all have
+static void shootdown_wait(tlb_gather_t *gather, uint64_t targets) {
+    request = gather;
+    __atomic_or_fetch(&pending, targets, __ATOMIC_SEQ_CST);
+    send_shootdowns(targets);
+    wait_shootdowns(targets);
+}
+
+// the PCID changes hands. Every CPU that has run it flushes it, and one
+// still running the previous owner is moved off it, before the new owner
+// gets it; only then can the CPUs that have run it start over
+void tlb_flush_pcid(uint64_t pcid) {
+    // no root and past the threshold: flushes the whole PCID and nothing
+    // else
+    tlb_gather_t gather;
+    tlb_gather_begin(&gather, pcid);
+    gather.count = TLB_FLUSH_THRESHOLD + 1;
+
+    uint64_t self = lapic_cached_id();
+    invalidate(&gather, self);
+
+    uint64_t bit = 1ULL << (pcid % 64);
+    uint64_t targets = 0;
+    for(uint64_t cpu = 0; cpu < KMEM_MAX_CPUS; cpu ++) {
+        if(cpu == self || !(TASK_PCID_RUN(cpu)[pcid / 64] & bit)) continue;
+        targets |= 1ULL << cpu;
+    }
+
+    if(targets) {
+        recycling = 1;
+        shootdown_wait(&gather, targets);
+        recycling = 0;
+    }
+
+    for(uint64_t cpu = 0; cpu < KMEM_MAX_CPUS; cpu ++) {
+        __atomic_and_fetch(TASK_PCID_RUN(cpu) + pcid / 64, ~bit,
+            __ATOMIC_SEQ_CST);
+    }
+}
+
+void tlb_gather_flush(tlb_gather_t *gather) {
+    if(gather->count > 0) {
+        uint64_t cr3 = gather->cr3 & ~KMEM_FLAG_MASK;
+        uint64_t pcid = gather->cr3 & KMEM_CR3_PCID_MASK;
+        uint64_t self = lapic_cached_id();
+        invalidate(gather, self);
+
+        // the table updates must be visible before the run bitmaps are read;
+        // a CPU that sets its bit after this loads the new tables anyway
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        // interrupt the other processors that may hold the translations: for
+        // a tagged address space, those that have run its PCID; for an
+        // untagged one, those running it now
+        uint64_t targets = 0;
+        for(uint64_t cpu = 0; cpu < KMEM_MAX_CPUS; cpu ++) {
+            if(cpu == self) continue;
+            if(pcid) {
+                if(!(TASK_PCID_RUN(cpu)[pcid / 64] & (1ULL << (pcid % 64)))) {
+                    continue;
+                }
+            }
+            else if(cpu_roots[cpu] != cr3) continue;
+            targets |= 1ULL << cpu;
+        }
+
+        if(targets) shootdown_wait(gather, targets);
+    }
+
+    // nothing can reach the held-back frames anymore
+    kmem_unusepages(gather->free_count, gather->frees);
+
+    gather->count = 0;
+    gather->free_count = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef SCHEDULER_TLB_H
+#define SCHEDULER_TLB_H
+
+#include <stdint.h>
+
+// beyond this many pages, a gather is flushed by reloading CR3 instead
+#define TLB_FLUSH_THRESHOLD 32
+// frames held back until the translations to them are gone
+#define TLB_GATHER_FREES 64
+
+#define TLB_SHOOTDOWN_VECTOR 0xfd
+// pause iterations to wait for shootdown interrupts to be answered, per try
+#define TLB_SHOOTDOWN_SPINS 10000000
+
+// collects the translations invalidated by one mapping operation
+typedef struct tlb_gather_t {
+    uint64_t cr3;
+    uint64_t count;
+    uint64_t addresses[TLB_FLUSH_THRESHOLD];
+    uint64_t free_count;
+    uint64_t frees[TLB_GATHER_FREES];
+} tlb_gather_t;
+
+void tlb_init(void);
+void tlb_switch(uint64_t cr3);
+void tlb_flush_pcid(uint64_t pcid);
+
+void tlb_gather_begin(tlb_gather_t *gather, uint64_t cr3);
+void tlb_gather_add(tlb_gather_t *gather, uint64_t address);
+void tlb_gather_free(tlb_gather_t *gather, uint64_t page);
+void tlb_gather_flush(tlb_gather_t *gather);
+
+#endif
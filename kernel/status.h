@@ -6,8 +6,58 @@
 #define STATUS_BASE (0xffff900000000000)
 #define STATUS_MEM ((kernel_status_t *)STATUS_BASE)
 
+#define STATUS_MAX_ROOTS 64
+#define STATUS_MAX_NODES 8
+#define STATUS_MAX_SLABS 8
+
+typedef struct kernel_status_root_t {
+    uint64_t root_id;
+    // 4KB pages mapped, and page-table pages holding them
+    uint64_t resident_pages;
+    uint64_t table_pages;
+} kernel_status_root_t;
+
+typedef struct kernel_status_slab_t {
+    char name[24];
+    uint64_t object_size;
+    // objects handed out, and objects carved so far
+    uint64_t active;
+    uint64_t total;
+} kernel_status_slab_t;
+
 typedef struct kernel_status_t {
     uint64_t timestamp;
+
+    // odd while the scheduler is updating the fields below
+    uint64_t sequence;
+
+    // physical memory, in 4KB frames
+    uint64_t total_frames;
+    uint64_t free_frames;
+    uint64_t used_frames;
+    uint64_t zeroed_frames;
+    uint64_t dma_free_frames;
+
+    // free frames on each NUMA node's list; the first node_count are valid
+    uint64_t node_count;
+    uint64_t node_free_frames[STATUS_MAX_NODES];
+
+    // page-table pages over all roots, and how many were released so far
+    uint64_t table_pages;
+    uint64_t tables_reclaimed;
+
+    // heap sizes, in bytes
+    uint64_t scheduler_heap;
+    uint64_t hw_heap;
+
+    // the first min(root_count, STATUS_MAX_ROOTS) entries of roots are valid
+    uint64_t root_count;
+    kernel_status_root_t roots[STATUS_MAX_ROOTS];
+
+    // the scheduler's slab caches; the first min(slab_count,
+    // STATUS_MAX_SLABS) entries are valid
+    uint64_t slab_count;
+    kernel_status_slab_t slabs[STATUS_MAX_SLABS];
 } kernel_status_t;
 
 #endif
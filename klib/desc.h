@@ -7,5 +7,10 @@
 #define DESC_INT_TASKS_ADDR (DESC_BASE + 0x2000)
 #define DESC_INT_TASKS_MEM ((uint64_t *)DESC_INT_TASKS_ADDR)
 #define DESC_INT_CODE_ADDR (DESC_BASE + 0x3000)
+#define DESC_TSS_ADDR (DESC_BASE + 0x100000)
+// separate stack for faults that can't trust the interrupted one
+#define DESC_IST_STACK_ADDR (DESC_BASE + 0x101000)
+#define DESC_IST_STACK_SIZE 0x1000
+#define DESC_IST_FAULT 1
 
 #endif
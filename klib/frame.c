@@ -0,0 +1,78 @@
+#include "clib/mem.h"
+
+#include "klib/synch.h"
+
+#include "kmem.h"
+#include "kmem_private.h"
+
+#define PHY_MAP_BASE 0xffffc00000000000ULL
+
+void kmem_frames_setup(uint64_t base, uint64_t count) {
+    // clearing all of it here would touch 4KB per MB of memory at boot, so
+    // each page of entries is cleared on first use instead
+    kmem_state->frames = base;
+    kmem_state->frame_count = count;
+    mem_set(kmem_state->frames_ready, 0, sizeof(kmem_state->frames_ready));
+}
+
+static int frames_ready(uint64_t chunk) {
+    uint64_t bits = __atomic_load_n(kmem_state->frames_ready + chunk / 64,
+        __ATOMIC_ACQUIRE);
+    return (bits >> (chunk % 64)) & 1;
+}
+
+static void frames_prepare(uint64_t chunk) {
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    if(!frames_ready(chunk)) {
+        mem_set((void *)(PHY_MAP_BASE + kmem_state->frames + chunk * 0x1000),
+            0, 0x1000);
+        __atomic_or_fetch(kmem_state->frames_ready + chunk / 64,
+            1ULL << (chunk % 64), __ATOMIC_RELEASE);
+    }
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+}
+
+kmem_frame_t *kmem_frame(uint64_t page) {
+    uint64_t pfn = page / 0x1000;
+    if(pfn >= kmem_state->frame_count) return 0;
+
+    uint64_t chunk = pfn / KMEM_FRAMES_PER_PAGE;
+    if(!frames_ready(chunk)) frames_prepare(chunk);
+
+    return (kmem_frame_t *)(PHY_MAP_BASE + kmem_state->frames) + pfn;
+}
+
+void kmem_frame_get(uint64_t page) {
+    kmem_frame_t *frame = kmem_frame(page);
+    if(frame) frame->refcount ++;
+}
+
+int kmem_frame_put(uint64_t page) {
+    kmem_frame_t *frame = kmem_frame(page);
+
+    // can't decrement a page already fully-decremented
+    if(frame == 0 || frame->refcount == 0) return 0;
+    if(--frame->refcount > 0) return 0;
+
+    // pinned frames aren't ours to release
+    if(frame->flags & KMEM_FRAME_PINNED) return 0;
+    frame->flags = 0;
+    frame->owner = 0;
+    return 1;
+}
+
+void kmem_frames_get(uint64_t count, const uint64_t *pages) {
+    for(uint64_t i = 0; i < count; i ++) kmem_frame_get(pages[i]);
+}
+
+uint64_t kmem_frames_put(uint64_t count, uint64_t *pages) {
+    uint64_t freed = 0;
+    for(uint64_t i = 0; i < count; i ++) {
+        if(kmem_frame_put(pages[i])) pages[freed++] = pages[i];
+    }
+    return freed;
+}
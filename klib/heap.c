@@ -4,20 +4,64 @@
 
 uint64_t heap_size;
 
-void *heap_klib_sizer(void __attribute__((unused)) *context, int64_t amount) {
-    if(amount < 0) return (uint8_t *)heap_get_start() + heap_size;
+uint64_t heap_klib_size(void) {
+    return heap_size;
+}
 
-    amount = (amount+0xfff) & ~0xfff;
+// until mman imports the scheduler's address space, heap pages are plain
+// allocations that the import then counts. Afterwards the sizer's context
+// points at the owning root's ID, and the heap holds a reference on every
+// page it maps, like any other mapping of the frame.
+static void heap_claim(uint64_t *owner, uint64_t page) {
+    if(!owner) return;
+
+    kmem_frame_get(page);
+    kmem_frame_t *frame = kmem_frame(page);
+    if(frame) frame->owner = *owner;
+}
+
+// unmaps [start, end) of the heap, freeing each page once nothing else
+// holds a reference to it
+static void heap_release(uint64_t start, uint64_t end) {
+    uint64_t root = kmem_current();
+    for(uint64_t p = start; p < end; p += 0x1000) {
+        uint64_t page = kmem_get_phy(root, p);
+        kmem_map(root, p, 0, 0);
+        if(!page) continue;
+
+        kmem_frame_t *frame = kmem_frame(page);
+        // never counted: mapped and released before the import
+        if(!frame || frame->refcount == 0) kmem_unuse(page);
+        else if(kmem_frame_put(page)) kmem_unuse(page);
+    }
+}
 
-    uint64_t new_size = heap_size + amount;
+void *heap_klib_sizer(void *context, int64_t amount) {
     uint64_t prev_end = (uint64_t)heap_get_start() + heap_size;
-    for(uint64_t p = prev_end; p < prev_end + new_size; p += 0x1000) {
-        kmem_map(kmem_current(), p, kmem_getpage(), KMEM_MAP_DATA);
+
+    if(amount < 0) {
+        // dlmalloc only gives back whole pages off the top
+        uint64_t shrink = (-amount) & ~0xfffULL;
+        if(shrink > heap_size) return (void *)-1;
+
+        heap_release(prev_end - shrink, prev_end);
+        heap_size -= shrink;
+        return (void *)prev_end;
+    }
+
+    amount = (amount+0xfff) & ~0xfff;
+
+    for(uint64_t p = prev_end; p < prev_end + amount; p += 0x1000) {
+        uint64_t page = kmem_getpage();
+        if(!page) {
+            heap_release(prev_end, p);
+            return (void *)-1;
+        }
+        kmem_map(kmem_current(), p, page, KMEM_MAP_DATA);
+        heap_claim(context, page);
     }
 
-    uint64_t old_size = heap_size;
-    heap_size = new_size;
+    heap_size += amount;
 
-    return (uint8_t *)heap_get_start() + old_size;
-    
+    return (void *)prev_end;
 }
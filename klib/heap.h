@@ -5,6 +5,8 @@
 
 #include "clib/heap.h"
 
+// context is 0, or points at the ID of the root to charge heap pages to
 void *heap_klib_sizer(void *context, int64_t amount);
+uint64_t heap_klib_size(void);
 
 #endif
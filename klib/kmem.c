@@ -2,35 +2,394 @@
 
 #include "klib/phy.h"
 #include "klib/d.h"
+#include "klib/synch.h"
+#include "klib/lapic.h"
 
 #include "kmem.h"
+#include "kmem_private.h"
 #include "task.h"
 #include "desc.h"
 
 #include "kernel/status.h"
 
-uint64_t temp_last;
-uint64_t *last_unused = &temp_last;
+static kmem_state_t kmem_temp_state;
+kmem_state_t *kmem_state = &kmem_temp_state;
 
 void kmem_setup() {
-    last_unused = (uint64_t *)KMEM_BASE_ADDR;
+    kmem_state = (kmem_state_t *)KMEM_BASE_ADDR;
 }
 
-void kmem_setup_bootstrap(uint64_t last) {
+void kmem_setup_bootstrap(uint64_t root) {
+    // map the shared allocator state; page tables and state pages both come
+    // out of the temporary state, so copy it over only afterwards
+    for(uint64_t off = 0; off < KMEM_STATE_SIZE; off += 0x1000) {
+        kmem_map(root, KMEM_BASE_ADDR + off, kmem_getpage(),
+            KMEM_MAP_DEFAULT | KMEM_MAP_GLOBAL);
+    }
+
+    kmem_state_t *temp = kmem_state;
     kmem_setup();
-    *last_unused = last;
+    mem_copy(kmem_state, temp, sizeof(kmem_state_t));
+}
+
+uint64_t kmem_irq_save(void) {
+    uint64_t flags;
+    __asm__ __volatile__(
+        "pushfq \n"
+        "pop    %%rax \n"
+        "cli"
+        : "=a"(flags) : : "memory");
+    return flags;
+}
+
+void kmem_irq_restore(uint64_t flags) {
+    if(flags & 0x200) __asm__ __volatile__("sti" : : : "memory");
+}
+
+// returns the calling CPU's page cache, or 0 if it has none; the caller must
+// have interrupts disabled so it is not switched away mid-operation
+static kmem_magazine_t *kmem_magazine(void) {
+    uint64_t cpu = lapic_cached_id();
+    if(cpu >= KMEM_MAX_CPUS) return 0;
+    return kmem_state->magazines + cpu;
+}
+
+// node whose memory the calling CPU prefers
+static uint64_t kmem_local_node(void) {
+    uint64_t cpu = lapic_cached_id();
+    if(cpu >= KMEM_MAX_CPUS) return 0;
+
+    uint64_t node = kmem_state->cpu_nodes[cpu];
+    return node < kmem_state->node_count ? node : 0;
+}
+
+// hands out up to count pages from the front of node's free ranges; the
+// caller must hold the lock
+static uint64_t range_pop(uint64_t node, uint64_t count, uint64_t *pages) {
+    uint64_t got = 0;
+    uint64_t i = 0;
+    while(i < kmem_state->free_range_count && got < count) {
+        kmem_free_range_t *range = kmem_state->free_ranges + i;
+        if(range->node != node) {
+            i ++;
+            continue;
+        }
+
+        while(got < count && range->next < range->end) {
+            pages[got++] = range->next;
+            range->next += 0x1000;
+        }
+
+        if(range->next == range->end) {
+            *range = kmem_state->free_ranges[--kmem_state->free_range_count];
+        }
+        else i ++;
+    }
+
+    return got;
+}
+
+uint64_t kmem_range_carve(uint64_t size, uint64_t limit) {
+    const uint8_t *fallback = kmem_state->nodes[kmem_local_node()].fallback;
+
+    for(uint64_t n = 0; n < kmem_state->node_count; n ++) {
+        for(uint64_t i = 0; i < kmem_state->free_range_count; i ++) {
+            kmem_free_range_t *range = kmem_state->free_ranges + i;
+            if(range->node != fallback[n]) continue;
+
+            uint64_t base = (range->next + size - 1) & ~(size - 1);
+            if(base < range->next || base + size > range->end) continue;
+            if(base + size > limit) continue;
+
+            // whatever is left on either side stays a range, which needs
+            // a second descriptor if there is something on both
+            if(base == range->next) range->next = base + size;
+            else if(base + size == range->end) range->end = base;
+            else if(kmem_state->free_range_count < KMEM_MAX_FREE_RANGES) {
+                kmem_free_range_t *rest =
+                    kmem_state->free_ranges + kmem_state->free_range_count++;
+                rest->next = base + size;
+                rest->end = range->end;
+                rest->node = range->node;
+                range->end = base;
+            }
+            else continue;
+
+            if(range->next == range->end) {
+                *range = kmem_state->free_ranges[--kmem_state->free_range_count];
+            }
+
+            kmem_state->nodes[fallback[n]].free_count -= size / 0x1000;
+            kmem_state->free_count -= size / 0x1000;
+            return base;
+        }
+    }
+
+    return 0;
+}
+
+// pops up to count pages off the node lists, taking from the calling CPU's
+// node first and then from the others by distance; pages already on a list
+// are reused before untouched ones. Takes the lock.
+static uint64_t global_pop(uint64_t count, uint64_t *pages) {
+    uint64_t got = 0;
+    const uint8_t *fallback = kmem_state->nodes[kmem_local_node()].fallback;
+
+    synch_spinlock(&kmem_state->lock);
+    for(uint64_t i = 0; i < kmem_state->node_count && got < count; i ++) {
+        kmem_node_t *node = kmem_state->nodes + fallback[i];
+        uint64_t before = got;
+        while(got < count && node->free_head) {
+            uint64_t page = node->free_head;
+            node->free_head = phy_read64(page);
+            pages[got++] = page;
+        }
+        got += range_pop(fallback[i], count - got, pages + got);
+        node->free_count -= got - before;
+    }
+    kmem_state->free_count -= got;
+    synch_spinunlock(&kmem_state->lock);
+
+    return got;
+}
+
+// pushes count pages onto the lists of their nodes; takes the lock
+static void global_push(uint64_t count, const uint64_t *pages) {
+    if(count == 0) return;
+
+    // link the batch into one chain per node before taking the lock, so
+    // that only the tails need to be written while holding it
+    uint64_t heads[KMEM_MAX_NODES], tails[KMEM_MAX_NODES];
+    uint64_t counts[KMEM_MAX_NODES];
+    for(uint64_t n = 0; n < KMEM_MAX_NODES; n ++) counts[n] = 0;
+
+    for(uint64_t i = 0; i < count; i ++) {
+        uint64_t n = kmem_node_of(pages[i]);
+        if(counts[n]) phy_write64(tails[n], pages[i]);
+        else heads[n] = pages[i];
+        tails[n] = pages[i];
+        counts[n] ++;
+    }
+
+    synch_spinlock(&kmem_state->lock);
+    for(uint64_t n = 0; n < KMEM_MAX_NODES; n ++) {
+        if(counts[n] == 0) continue;
+
+        kmem_node_t *node = kmem_state->nodes + n;
+        phy_write64(tails[n], node->free_head);
+        node->free_head = heads[n];
+        node->free_count += counts[n];
+    }
+    kmem_state->free_count += count;
+    synch_spinunlock(&kmem_state->lock);
 }
 
 void kmem_unuse(uint64_t page) {
-    phy_write64(page, *last_unused);
-    *last_unused = page;
+    kmem_unusepages(1, &page);
+}
+
+void kmem_unusepages(uint64_t count, const uint64_t *pages) {
+    uint64_t flags = kmem_irq_save();
+
+    kmem_magazine_t *mag = kmem_magazine();
+    while(count > 0) {
+        // pages carved out for the buddy zones go back to their zone
+        kmem_zone_t *zone = kmem_zone_of(*pages);
+        if(zone) {
+            synch_spinlock(&kmem_state->lock);
+            kmem_zone_free(zone, *pages, 0);
+            synch_spinunlock(&kmem_state->lock);
+
+            pages ++;
+            count --;
+            continue;
+        }
+
+        if(!mag) {
+            global_push(1, pages);
+            pages ++;
+            count --;
+            continue;
+        }
+
+        // drain a batch when full
+        if(mag->count == KMEM_MAGAZINE_SIZE) {
+            mag->count -= KMEM_MAGAZINE_BATCH;
+            global_push(KMEM_MAGAZINE_BATCH, mag->pages + mag->count);
+        }
+
+        mag->pages[mag->count++] = *pages;
+        pages ++;
+        count --;
+    }
+
+    kmem_irq_restore(flags);
+}
+
+void kmem_unuse_range(uint64_t base, uint64_t size) {
+    uint64_t end = (base + size) & ~0xfffULL;
+    base = (base + 0xfff) & ~0xfffULL;
+
+    while(base < end) {
+        // a range never spans nodes
+        uint64_t span;
+        uint64_t node = kmem_node_span(base, &span);
+        if(span > end) span = end;
+
+        uint64_t flags = kmem_irq_save();
+        synch_spinlock(&kmem_state->lock);
+        int added = 0;
+        if(kmem_state->free_range_count < KMEM_MAX_FREE_RANGES) {
+            kmem_free_range_t *range =
+                kmem_state->free_ranges + kmem_state->free_range_count++;
+            range->next = base;
+            range->end = span;
+            range->node = node;
+
+            uint64_t pages = (span - base) / 0x1000;
+            kmem_state->nodes[node].free_count += pages;
+            kmem_state->free_count += pages;
+            added = 1;
+        }
+        synch_spinunlock(&kmem_state->lock);
+        kmem_irq_restore(flags);
+
+        // out of descriptors: fall back to the free lists
+        if(!added) {
+            for(uint64_t p = base; p < span; p += 0x1000) kmem_unuse(p);
+        }
+
+        base = span;
+    }
 }
 
 uint64_t kmem_getpage() {
-    // TODO: handle error conditions!
-    uint64_t ret = *last_unused;
-    *last_unused = phy_read64(ret);
-    return ret;
+    uint64_t page;
+    if(kmem_getpages(1, &page) == 0) return 0;
+    return page;
+}
+
+uint64_t kmem_getpages(uint64_t count, uint64_t *pages) {
+    uint64_t flags = kmem_irq_save();
+    uint64_t got = 0;
+
+    kmem_magazine_t *mag = kmem_magazine();
+    while(mag && got < count) {
+        // large requests bypass the magazine once it is empty
+        if(mag->count == 0) {
+            if(count - got >= KMEM_MAGAZINE_BATCH) break;
+
+            mag->count = global_pop(KMEM_MAGAZINE_BATCH, mag->pages);
+            if(mag->count == 0) break;
+        }
+
+        pages[got++] = mag->pages[--mag->count];
+    }
+
+    if(got < count) got += global_pop(count - got, pages + got);
+
+    // fall back to the buddy zones once the free list runs dry
+    if(got < count) {
+        synch_spinlock(&kmem_state->lock);
+        for(int z = KMEM_ZONE_COUNT - 1; z >= 0 && got < count; z --) {
+            uint64_t page;
+            while(got < count
+                && (page = kmem_zone_alloc(kmem_state->zones + z, 0))) {
+
+                pages[got++] = page;
+            }
+        }
+        synch_spinunlock(&kmem_state->lock);
+    }
+
+    kmem_irq_restore(flags);
+
+    // short only once memory has run out; the pages taken are the caller's
+    return got;
+}
+
+uint64_t kmem_getpage_zeroed() {
+    uint64_t page;
+    if(kmem_getpages_zeroed(1, &page) == 0) return 0;
+    return page;
+}
+
+uint64_t kmem_getpages_zeroed(uint64_t count, uint64_t *pages) {
+    uint64_t flags = kmem_irq_save();
+    uint64_t got = 0;
+
+    synch_spinlock(&kmem_state->lock);
+    while(got < count && kmem_state->zero_head) {
+        uint64_t page = kmem_state->zero_head;
+        kmem_state->zero_head = phy_read64(page);
+        pages[got++] = page;
+    }
+    kmem_state->zero_count -= got;
+    synch_spinunlock(&kmem_state->lock);
+
+    kmem_irq_restore(flags);
+
+    // clear the link left in each pooled page
+    for(uint64_t i = 0; i < got; i ++) phy_write64(pages[i], 0);
+
+    // pool ran dry: clear the rest here
+    uint64_t pooled = got;
+    if(got < count) got += kmem_getpages(count - got, pages + got);
+    for(uint64_t i = pooled; i < got; i ++) phy_clear(pages[i], 0x1000);
+
+    return got;
+}
+
+uint64_t kmem_zero_refill(uint64_t max) {
+    if(kmem_state->zero_count >= KMEM_ZERO_POOL_SIZE) return 0;
+    if(max > KMEM_ZERO_POOL_SIZE - kmem_state->zero_count) {
+        max = KMEM_ZERO_POOL_SIZE - kmem_state->zero_count;
+    }
+
+    uint64_t pages[KMEM_ZERO_BATCH];
+    if(max > KMEM_ZERO_BATCH) max = KMEM_ZERO_BATCH;
+    uint64_t count = kmem_getpages(max, pages);
+    if(count == 0) return 0;
+
+    // clear and link the batch before taking the lock
+    for(uint64_t i = 0; i < count; i ++) {
+        phy_clear(pages[i], 0x1000);
+        if(i + 1 < count) phy_write64(pages[i], pages[i+1]);
+    }
+
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+    phy_write64(pages[count-1], kmem_state->zero_head);
+    kmem_state->zero_head = pages[0];
+    kmem_state->zero_count += count;
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+
+    return count;
+}
+
+void kmem_get_stats(kmem_stats_t *stats) {
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    stats->total = kmem_state->total_pages;
+    stats->zeroed = kmem_state->zero_count;
+    stats->free = kmem_state->free_count + kmem_state->zero_count;
+    for(int z = 0; z < KMEM_ZONE_COUNT; z ++) {
+        stats->zone_free[z] = kmem_state->zones[z].free_pages;
+        stats->free += stats->zone_free[z];
+    }
+    // read without their owners' cooperation, so only approximately right
+    for(int i = 0; i < KMEM_MAX_CPUS; i ++) {
+        stats->free += kmem_state->magazines[i].count;
+    }
+    stats->node_count = kmem_state->node_count;
+    for(int n = 0; n < KMEM_MAX_NODES; n ++) {
+        stats->node_free[n] = kmem_state->nodes[n].free_count;
+    }
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
 }
 
 uint64_t kmem_paging_addr(uint64_t root, uint64_t address, uint8_t level,
@@ -41,67 +400,178 @@ uint64_t kmem_paging_addr(uint64_t root, uint64_t address, uint8_t level,
     //          1 -> 30
     //          2 -> 21
     //          3 -> 12
-    uint64_t index = (address >> (12 + (3-level)*9)) & 0x1ff;
+    uint64_t table = root;
+    for(uint8_t l = 0; ; l ++) {
+        uint64_t addr = table + KMEM_LEVEL_INDEX(address, l) * 8;
+        if(l == level) {
+            *ok = 1;
+            return addr;
+        }
+
+        uint64_t entry = phy_read64(addr);
 
-    if(level == 0) {
-        *ok = 1;
-        return root + index * 8;
+        // a large leaf has no table below it
+        if((entry & 1) == 0 || (entry & KMEM_PAGE_LARGE)) {
+            *ok = 0;
+            return 0;
+        }
+
+        table = entry & ~KMEM_FLAG_MASK;
     }
-    else {
-        uint64_t prev = kmem_paging_addr(root, address, level-1, ok);
+}
 
-        if(!*ok) return 0;
+// walks down to the entry that maps address: a level 3 entry, a large leaf,
+// or the first non-present entry on the way. Returns the entry's address.
+uint64_t kmem_paging_leaf(uint64_t root, uint64_t address, uint8_t *level) {
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root, address);
+    *level = cursor.level;
+    return kmem_cursor_entry(&cursor);
+}
 
-        uint64_t entry = phy_read64(prev);
+// replaces the large leaf at entry_addr with a table of next-level entries
+// mapping the same memory; returns the new table, or 0 on failure
+uint64_t kmem_split(uint64_t entry_addr, uint8_t level) {
+    uint64_t entry = phy_read64(entry_addr);
+    uint64_t base = entry & ~KMEM_FLAG_MASK & ~(KMEM_LEVEL_SIZE(level) - 1);
+    uint64_t flags = entry & KMEM_FLAG_MASK;
+    // level 3 entries have no size bit
+    if(level + 1 == 3) flags &= ~KMEM_PAGE_LARGE;
 
-        if((entry & 1) == 0) {
-            *ok = 0;
-            return 0;
+    uint64_t table = kmem_getpage();
+    if(!table) return 0;
+
+    for(uint64_t i = 0; i < 512; i ++) {
+        phy_write64(table + i*8, (base + i * KMEM_LEVEL_SIZE(level + 1)) | flags);
+    }
+    phy_write64(entry_addr, table | 0x7);
+
+    return table;
+}
+
+// descends from the table at the cursor's current level until reaching the
+// entry that maps the cursor's address
+static void kmem_cursor_descend(kmem_cursor_t *cursor) {
+    while(cursor->level < 3) {
+        uint64_t entry = phy_read64(kmem_cursor_entry(cursor));
+        if((entry & 1) == 0 || (entry & KMEM_PAGE_LARGE)) return;
+
+        cursor->tables[++cursor->level] = entry & ~KMEM_FLAG_MASK;
+    }
+}
+
+void kmem_cursor_begin(kmem_cursor_t *cursor, uint64_t root,
+    uint64_t address) {
+
+    cursor->address = address;
+    cursor->level = 0;
+    cursor->tables[0] = root;
+    kmem_cursor_descend(cursor);
+}
+
+void kmem_cursor_seek(kmem_cursor_t *cursor, uint64_t address) {
+    uint64_t old = cursor->address;
+    cursor->address = address;
+
+    // tables above the shallowest changed index are still the right ones
+    for(uint8_t l = 0; l <= cursor->level; l ++) {
+        if(KMEM_LEVEL_INDEX(old, l) != KMEM_LEVEL_INDEX(address, l)) {
+            cursor->level = l;
+            kmem_cursor_descend(cursor);
+            return;
         }
+    }
+}
+
+void kmem_cursor_next(kmem_cursor_t *cursor) {
+    uint64_t size = KMEM_LEVEL_SIZE(cursor->level);
+    kmem_cursor_seek(cursor, (cursor->address & ~(size - 1)) + size);
+}
+
+uint64_t kmem_cursor_entry(kmem_cursor_t *cursor) {
+    return cursor->tables[cursor->level]
+        + KMEM_LEVEL_INDEX(cursor->address, cursor->level) * 8;
+}
+
+uint64_t kmem_cursor_get(kmem_cursor_t *cursor) {
+    return phy_read64(kmem_cursor_entry(cursor));
+}
+
+void kmem_cursor_set(kmem_cursor_t *cursor, uint64_t entry) {
+    phy_write64(kmem_cursor_entry(cursor), entry);
+}
 
-        entry &= ~0xfff;
+uint64_t kmem_cursor_span(kmem_cursor_t *cursor) {
+    uint64_t size = KMEM_LEVEL_SIZE(cursor->level);
+    return size - (cursor->address & (size - 1));
+}
+
+uint64_t kmem_cursor_create(kmem_cursor_t *cursor, uint8_t level,
+    void (*new_table)(void *context, uint64_t table), void *context) {
+
+    // a table already exists further down; stop at the requested level
+    if(cursor->level > level) cursor->level = level;
+
+    while(cursor->level < level) {
+        uint64_t eaddr = kmem_cursor_entry(cursor);
+        uint64_t entry = phy_read64(eaddr);
+        uint64_t table;
+
+        if((entry & 1) && (entry & KMEM_PAGE_LARGE)) {
+            table = kmem_split(eaddr, cursor->level);
+            if(!table) return 0;
+            if(new_table) new_table(context, table);
+        }
+        else if(entry & 1) {
+            table = entry & ~KMEM_FLAG_MASK;
+        }
+        else {
+            table = kmem_getpage_zeroed();
+            if(!table) return 0;
+            phy_write64(eaddr, table | 0x7);
+            if(new_table) new_table(context, table);
+        }
 
-        return entry + index * 8;
+        cursor->tables[++cursor->level] = table;
     }
+
+    return kmem_cursor_entry(cursor);
 }
 
 static uint64_t kmem_paging_addr_create(uint64_t root, uint64_t vaddr,
     uint8_t level) {
 
-    uint8_t ok;
-    uint64_t addr = kmem_paging_addr(root, vaddr, level, &ok);
-
-    if(!ok) {
-        // need to allocate some intermediate entries
-        uint64_t pa = -1;
-        for(int i = 0; i <= level; i ++) {
-            uint64_t a = kmem_paging_addr(root, vaddr, i, &ok);
-            if(!ok) {
-                uint64_t ntable = kmem_getpage();
-                for(int i = 0; i < 512; i ++) phy_write64(ntable + i*8, 0);
-                phy_write64(pa, ntable | 0x7);
-                a = kmem_paging_addr(root, vaddr, i, &ok);
-            }
-            pa = a;
-        }
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root, vaddr);
+    return kmem_cursor_create(&cursor, level, 0, 0);
+}
 
-        addr = kmem_paging_addr(root, vaddr, level, &ok);
-    }
+uint64_t kmem_get_phy(uint64_t root, uint64_t vaddr) {
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root, vaddr);
 
-    return addr;
+    uint64_t entry = kmem_cursor_get(&cursor);
+    if(!(entry & KMEM_PAGE_PRESENT)) return 0;
+
+    uint64_t lmask = KMEM_LEVEL_SIZE(cursor.level) - 1;
+    return (entry & ~KMEM_FLAG_MASK & ~lmask) | (vaddr & lmask);
 }
 
 uint64_t kmem_current() {
     uint64_t current = 0;
     __asm__ __volatile__ ("mov %%cr3, %%rax" : "=a"(current));
-    return current;
+    // drop the PCID, if any
+    return current & ~KMEM_CR3_PCID_MASK;
 }
 
-uint64_t kmem_create_root() {
-    uint64_t ret = kmem_getpage();
+int kmem_pcid_enabled() {
+    uint64_t cr4;
+    __asm__ __volatile__ ("mov %%cr4, %%rax" : "=a"(cr4));
+    return !!(cr4 & (1<<17));
+}
 
-    // zero out root
-    for(int i = 0; i < 512; i ++) phy_write64(ret + i*8, 0);
+uint64_t kmem_create_root() {
+    uint64_t ret = kmem_getpage_zeroed();
 
     // add physical memory map
     // this uses 1GB pages, so want entry in level 0 (that covers phy and more)
@@ -129,60 +599,82 @@ uint64_t kmem_create_root() {
     return ret;
 }
 
+// drops a replaced translation that may still be cached; global ones
+// survive CR3 switches, so they count even when root isn't loaded
+static void kmem_invalidate(uint64_t root, uint64_t vaddr, uint64_t old,
+    uint64_t flags) {
+
+    if(!(old & 1)) return;
+    if(root != kmem_current() && !((old | flags) & KMEM_MAP_GLOBAL)) return;
+
+    __asm__ __volatile__("invlpg (%%rax)" : : "a"(vaddr) : "memory");
+}
+
 void kmem_map(uint64_t root, uint64_t vaddr, uint64_t page, uint64_t flags) {
     uint64_t addr = kmem_paging_addr_create(root, vaddr, 3);
+    uint64_t old = phy_read64(addr);
     phy_write64(addr, page | flags);
+    kmem_invalidate(root, vaddr, old, flags);
+}
+
+void kmem_map_large(uint64_t root, uint64_t vaddr, uint64_t page,
+    uint8_t level, uint64_t flags) {
+
+    uint64_t addr = kmem_paging_addr_create(root, vaddr, level);
+    phy_write64(addr, page | flags | KMEM_PAGE_LARGE);
 }
 
 void kmem_set_flags(uint64_t root, uint64_t vaddr, uint64_t flags) {
     uint64_t addr = kmem_paging_addr_create(root, vaddr, 3);
-    phy_write64(addr, (phy_read64(addr) & ~KMEM_FLAG_MASK) | flags);
+    uint64_t old = phy_read64(addr);
+    phy_write64(addr, (old & ~KMEM_FLAG_MASK) | flags);
+    kmem_invalidate(root, vaddr, old, flags);
 }
 
 void kmem_memcpy(uint64_t root, uint64_t vaddr, void *data, uint64_t size) {
-    uint8_t ok;
-    // NOTE: this assumes 4KB pages!
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root, vaddr);
     while(size > 0) {
-        uint64_t pg = vaddr & ~0xfff;
-        uint64_t pg_off = vaddr & 0xfff;
-
-        uint64_t entry = kmem_paging_addr(root, pg, 3, &ok);
-        if(!ok) {
+        uint64_t entry = kmem_cursor_get(&cursor);
+        if((entry & 1) == 0) {
             return;
         }
-        uint64_t phy_addr = phy_read64(entry) & ~KMEM_FLAG_MASK;
 
-        uint64_t wsize = 0x1000 - pg_off;
+        uint64_t pg_size = KMEM_LEVEL_SIZE(cursor.level);
+        uint64_t pg_off = cursor.address & (pg_size - 1);
+        uint64_t phy_addr = entry & ~KMEM_FLAG_MASK & ~(pg_size - 1);
+
+        uint64_t wsize = kmem_cursor_span(&cursor);
         if(wsize > size) wsize = size;
 
         mem_copy((void *)(0xffffc00000000000ULL + phy_addr + pg_off),
             data, wsize);
 
         data += wsize;
-        vaddr += wsize;
         size -= wsize;
+        kmem_cursor_next(&cursor);
     }
 }
 
 void kmem_memclr(uint64_t root, uint64_t vaddr, uint64_t size) {
-    uint8_t ok;
-    // NOTE: this assumes 4KB pages!
+    kmem_cursor_t cursor;
+    kmem_cursor_begin(&cursor, root, vaddr);
     while(size > 0) {
-        uint64_t pg = vaddr & ~0xfff;
-        uint64_t pg_off = vaddr & 0xfff;
-
-        uint64_t entry = kmem_paging_addr(root, pg, 3, &ok);
-        if(!ok) {
+        uint64_t entry = kmem_cursor_get(&cursor);
+        if((entry & 1) == 0) {
             return;
         }
-        uint64_t phy_addr = phy_read64(entry) & ~KMEM_FLAG_MASK;
 
-        uint64_t wsize = 0x1000 - pg_off;
+        uint64_t pg_size = KMEM_LEVEL_SIZE(cursor.level);
+        uint64_t pg_off = cursor.address & (pg_size - 1);
+        uint64_t phy_addr = entry & ~KMEM_FLAG_MASK & ~(pg_size - 1);
+
+        uint64_t wsize = kmem_cursor_span(&cursor);
         if(wsize > size) wsize = size;
 
         mem_set((void *)(0xffffc00000000000ULL + phy_addr + pg_off), 0, wsize);
 
-        vaddr += wsize;
         size -= wsize;
+        kmem_cursor_next(&cursor);
     }
 }
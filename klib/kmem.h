@@ -4,25 +4,179 @@
 #include <stdint.h>
 
 #define KMEM_BASE_ADDR 0xffffffffffa00000
+// space mapped there for the allocator state; see doc/memory-map
+#define KMEM_STATE_SIZE 0x5000
+
+// per-CPU page caches, refilled from and drained to the global free list
+#define KMEM_MAX_CPUS 16
+#define KMEM_MAGAZINE_SIZE 64
+#define KMEM_MAGAZINE_BATCH 32
+
+// pages cleared ahead of time by an idle task; refilled a batch at a time
+#define KMEM_ZERO_POOL_SIZE 256
+#define KMEM_ZERO_BATCH 16
+
+// buddy zones for physically contiguous allocations, up to 2MB blocks
+#define KMEM_ZONE_DMA32 0
+#define KMEM_ZONE_NORMAL 1
+#define KMEM_ZONE_COUNT 2
+#define KMEM_MAX_ORDER 9
+#define KMEM_ZONE_MAX_SIZE 0x1000000
+// blocks the zones can't supply, up to 1GB, are cut out of the untouched
+// free ranges instead
+#define KMEM_MAX_RUN_ORDER 18
+
+// NUMA nodes, each with its own free list; everything belongs to node 0
+// until the hw task reports the firmware's topology
+#define KMEM_MAX_NODES 8
+#define KMEM_MAX_NUMA_RANGES 32
+// SLIT distance of a node to itself; used for any pair left unreported
+#define KMEM_NUMA_LOCAL 10
+#define KMEM_NUMA_REMOTE 20
+
+// per-frame metadata, one entry per physical page
+#define KMEM_FRAME_TABLE  0x01 // page-table page
+#define KMEM_FRAME_DMA    0x02 // handed out for device access
+#define KMEM_FRAME_PINNED 0x04 // must stay mapped where it is
+// the physmap covers 64GB, so no frame beyond that can be used anyway
+#define KMEM_FRAME_MAX (0x1000000000ULL / 0x1000)
+// metadata is cleared a page of entries at a time, when first looked at
+#define KMEM_FRAMES_PER_PAGE (0x1000 / 16)
+
+// free memory nobody has touched yet; pages are handed out from the front
+// of a range before they ever see the free lists
+#define KMEM_MAX_FREE_RANGES 64
+
+typedef struct kmem_frame_t {
+    uint32_t refcount;
+    uint32_t flags;
+    // root that allocated the frame, if any
+    uint64_t owner;
+} kmem_frame_t;
+
+// snapshot of allocator counters, in pages
+typedef struct kmem_stats_t {
+    uint64_t total;
+    uint64_t free;
+    uint64_t zeroed;
+    uint64_t zone_free[KMEM_ZONE_COUNT];
+    // free list and ranges of each node; excludes per-CPU caches and the
+    // zero pool
+    uint64_t node_count;
+    uint64_t node_free[KMEM_MAX_NODES];
+} kmem_stats_t;
 
 #define KMEM_MAP_DEFAULT 0x7
 #define KMEM_MAP_RO_DATA (0x1 | (1ULL<<63))
 #define KMEM_MAP_DATA (0x3 | (1ULL<<63))
 #define KMEM_MAP_CODE (0x5)
+// for mappings shared by every root; kept in the TLB across CR3 switches
+#define KMEM_MAP_GLOBAL 0x100
+
+// bits 52-62 are ignored by the MMU and free for software use
+#define KMEM_FLAG_MASK (0xfff | (0xfffULL<<52))
+
+// CR3 bits for tagged address spaces
+#define KMEM_CR3_PCID_MASK 0xfff
+#define KMEM_CR3_NOFLUSH (1ULL<<63)
+#define KMEM_PCID_COUNT 4096
 
-#define KMEM_FLAG_MASK (0xfff | (1ULL<<63))
+#define KMEM_PAGE_PRESENT 0x01
+#define KMEM_PAGE_WRITE 0x02
+#define KMEM_PAGE_LARGE 0x80
+
+// software bits of present entries
+#define KMEM_PAGE_COW (1ULL<<52) // frame may be shared; copy before writing
+#define KMEM_PAGE_COW_WRITE (1ULL<<53) // write access held back by KMEM_PAGE_COW
+
+// software bits of non-present level 3 entries
+#define KMEM_PAGE_RESERVED 0x200 // filled with a zeroed page on first touch
+#define KMEM_PAGE_GUARD 0x400 // never filled; touching it is fatal
+#define KMEM_PAGE_HUGE_HINT 0x800 // part of a reserved aligned 2MB stretch
+
+// a reserved data page, as written in place of KMEM_MAP_DATA
+#define KMEM_MAP_RESERVED (0x2 | (1ULL<<63) | KMEM_PAGE_RESERVED)
+
+// bytes mapped by a single entry at each paging level
+#define KMEM_LEVEL_SIZE(level) (1ULL << (12 + (3 - (level)) * 9))
+// index of the entry for address within its table at the given level
+#define KMEM_LEVEL_INDEX(address, level) \
+    (((address) >> (12 + (3 - (level)) * 9)) & 0x1ff)
+
+// iterates over the entries of one set of page tables, remembering the table
+// at each level so that moving forwards only re-walks from the shallowest
+// level whose index changed
+typedef struct kmem_cursor_t {
+    uint64_t address;
+    // level of the current entry: a level 3 entry, a large leaf, or the
+    // first non-present entry on the way down
+    uint8_t level;
+    uint64_t tables[4];
+} kmem_cursor_t;
 
 void kmem_setup(void);
-void kmem_setup_bootstrap(uint64_t last);
+void kmem_setup_bootstrap(uint64_t root);
 
 void kmem_unuse(uint64_t page);
+void kmem_unusepages(uint64_t count, const uint64_t *pages);
+void kmem_unuse_range(uint64_t base, uint64_t size);
 uint64_t kmem_getpage(void);
+// fills pages with up to count pages and returns how many it got; fewer
+// than count means memory ran out, and the caller owns the ones it did get
+uint64_t kmem_getpages(uint64_t count, uint64_t *pages);
+uint64_t kmem_getpage_zeroed(void);
+uint64_t kmem_getpages_zeroed(uint64_t count, uint64_t *pages);
+uint64_t kmem_zero_refill(uint64_t max);
+void kmem_get_stats(kmem_stats_t *stats);
+
+// the topology can only be applied once, and not changed after that; these
+// return 1 if it already has been
+int kmem_numa_add_range(uint64_t base, uint64_t size, uint64_t node);
+int kmem_numa_set_cpu(uint64_t cpu, uint64_t node);
+int kmem_numa_set_distance(uint64_t from, uint64_t to, uint64_t distance);
+int kmem_numa_apply(void);
+uint64_t kmem_node_of(uint64_t page);
+uint64_t kmem_node_span(uint64_t page, uint64_t *end);
+
+void kmem_frames_setup(uint64_t base, uint64_t count);
+kmem_frame_t *kmem_frame(uint64_t page);
+void kmem_frame_get(uint64_t page);
+// drops a reference; returns 1 if it was the last and the frame is now free
+// to be released, which a pinned one never is
+int kmem_frame_put(uint64_t page);
+// the same for a batch; kmem_frames_put moves the frames that are now free
+// to the front of pages and returns how many there are
+void kmem_frames_get(uint64_t count, const uint64_t *pages);
+uint64_t kmem_frames_put(uint64_t count, uint64_t *pages);
+
+void kmem_zone_setup(int zone, uint64_t base, uint64_t size);
+uint64_t kmem_order(uint64_t size);
+uint64_t kmem_getblock(int zone, uint64_t order);
+void kmem_unuseblock(uint64_t base, uint64_t order);
 
 uint64_t kmem_paging_addr(uint64_t root, uint64_t address, uint8_t level,
     uint8_t *ok);
+uint64_t kmem_paging_leaf(uint64_t root, uint64_t address, uint8_t *level);
+uint64_t kmem_split(uint64_t entry_addr, uint8_t level);
+
+void kmem_cursor_begin(kmem_cursor_t *cursor, uint64_t root,
+    uint64_t address);
+void kmem_cursor_seek(kmem_cursor_t *cursor, uint64_t address);
+void kmem_cursor_next(kmem_cursor_t *cursor);
+uint64_t kmem_cursor_entry(kmem_cursor_t *cursor);
+uint64_t kmem_cursor_get(kmem_cursor_t *cursor);
+void kmem_cursor_set(kmem_cursor_t *cursor, uint64_t entry);
+uint64_t kmem_cursor_span(kmem_cursor_t *cursor);
+uint64_t kmem_cursor_create(kmem_cursor_t *cursor, uint8_t level,
+    void (*new_table)(void *context, uint64_t table), void *context);
+
+uint64_t kmem_get_phy(uint64_t root, uint64_t vaddr);
 uint64_t kmem_current(void);
+int kmem_pcid_enabled(void);
 uint64_t kmem_create_root(void);
 void kmem_map(uint64_t root, uint64_t vaddr, uint64_t page, uint64_t flags);
+void kmem_map_large(uint64_t root, uint64_t vaddr, uint64_t page,
+    uint8_t level, uint64_t flags);
 void kmem_set_flags(uint64_t root, uint64_t vaddr, uint64_t flags);
 
 void kmem_memcpy(uint64_t root, uint64_t vaddr, void *data, uint64_t size);
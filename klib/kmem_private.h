@@ -0,0 +1,103 @@
+#ifndef KMEM_PRIVATE_H
+#define KMEM_PRIVATE_H
+
+#include <stdint.h>
+
+#include "klib/synch.h"
+
+#include "kmem.h"
+
+typedef struct kmem_magazine_t {
+    uint64_t count;
+    uint64_t pages[KMEM_MAGAZINE_SIZE];
+} kmem_magazine_t;
+
+typedef struct kmem_zone_t {
+    uint64_t base;
+    uint64_t pages;
+    // physical address of a byte per page: KMEM_ZONE_FREE | order for the
+    // first page of every free block, zero otherwise
+    uint64_t order_map;
+    uint64_t free_pages;
+    // heads of doubly-linked free lists, one per order; the links live in
+    // the first two qwords of each free block
+    uint64_t free_heads[KMEM_MAX_ORDER + 1];
+} kmem_zone_t;
+
+#define KMEM_ZONE_FREE 0x80
+
+// pages [next, end) of node are free and have never been written to
+typedef struct kmem_free_range_t {
+    uint64_t next;
+    uint64_t end;
+    uint64_t node;
+} kmem_free_range_t;
+
+typedef struct kmem_node_t {
+    uint64_t free_head;
+    // pages on the list plus those left in the node's free ranges
+    uint64_t free_count;
+    // nodes to take pages from, nearest first; starts with the node itself
+    uint8_t fallback[KMEM_MAX_NODES];
+} kmem_node_t;
+
+// physical memory [base, end) belongs to node
+typedef struct kmem_numa_range_t {
+    uint64_t base;
+    uint64_t end;
+    uint64_t node;
+} kmem_numa_range_t;
+
+typedef struct kmem_state_t {
+    // per-node intrusive free lists and zones, protected by lock
+    spinlock_t lock;
+    uint64_t free_count;
+    uint64_t node_count;
+    kmem_node_t nodes[KMEM_MAX_NODES];
+    uint64_t free_range_count;
+    kmem_free_range_t free_ranges[KMEM_MAX_FREE_RANGES];
+
+    // topology as reported by firmware; written only while booting, and
+    // fixed once applied
+    uint64_t numa_applied;
+    uint64_t range_count;
+    kmem_numa_range_t ranges[KMEM_MAX_NUMA_RANGES];
+    uint8_t cpu_nodes[KMEM_MAX_CPUS];
+    uint8_t distance[KMEM_MAX_NODES][KMEM_MAX_NODES];
+
+    // intrusive list of cleared pages; only the link qword is non-zero
+    uint64_t zero_head;
+    uint64_t zero_count;
+
+    kmem_zone_t zones[KMEM_ZONE_COUNT];
+
+    // every page handed to the allocator at boot, zones included
+    uint64_t total_pages;
+
+    // physical address and length of the kmem_frame_t array, and a bit per
+    // page of it that has been cleared
+    uint64_t frames;
+    uint64_t frame_count;
+    uint64_t frames_ready[KMEM_FRAME_MAX / KMEM_FRAMES_PER_PAGE / 64];
+
+    kmem_magazine_t magazines[KMEM_MAX_CPUS];
+} kmem_state_t;
+
+_Static_assert(sizeof(kmem_state_t) <= KMEM_STATE_SIZE,
+    "kmem_state_t outgrew the space mapped at KMEM_BASE_ADDR");
+
+extern kmem_state_t *kmem_state;
+
+uint64_t kmem_irq_save(void);
+void kmem_irq_restore(uint64_t flags);
+
+// takes a naturally aligned run of size bytes, all below limit, out of the
+// free ranges; the caller must hold kmem_state->lock
+uint64_t kmem_range_carve(uint64_t size, uint64_t limit);
+
+// zone operations; the caller must hold kmem_state->lock
+kmem_zone_t *kmem_zone_of(uint64_t page);
+uint64_t kmem_zone_alloc(kmem_zone_t *zone, uint64_t order);
+void kmem_zone_free(kmem_zone_t *zone, uint64_t base, uint64_t order);
+
+#endif
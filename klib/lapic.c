@@ -7,6 +7,8 @@
 #define LAPIC_REG_EOI 0xb
 #define LAPIC_REG_SPURIOUS 0xf
 #define LAPIC_REG_ISR 0x10
+#define LAPIC_REG_ICR_LOW 0x30
+#define LAPIC_REG_ICR_HIGH 0x31
 #define LAPIC_REG_TIMER 0x32
 #define LAPIC_REG_TIMER_ICR 0x38
 #define LAPIC_REG_TIMER_DIVIDE 0x3e
@@ -28,6 +30,48 @@ uint8_t lapic_id() {
     return get_reg(LAPIC_REG_ID);
 }
 
+uint8_t lapic_initial_id() {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid"
+        : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+    return ebx >> 24;
+}
+
+// 0 until probed, then whether RDTSCP is available
+#define CACHED_ID_UNKNOWN 0
+#define CACHED_ID_RDTSCP 1
+#define CACHED_ID_CPUID 2
+static uint8_t cached_id_mode;
+
+int lapic_has_rdtscp() {
+    uint32_t eax = 0x80000000, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid"
+        : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if(eax < 0x80000001) return 0;
+
+    eax = 0x80000001, ecx = 0;
+    __asm__ __volatile__("cpuid"
+        : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return !!(edx & (1<<27));
+}
+
+void lapic_cache_id() {
+    if(lapic_has_rdtscp()) msr_write(MSR_TSC_AUX, lapic_initial_id());
+}
+
+uint8_t lapic_cached_id() {
+    if(cached_id_mode == CACHED_ID_UNKNOWN) {
+        cached_id_mode =
+            lapic_has_rdtscp() ? CACHED_ID_RDTSCP : CACHED_ID_CPUID;
+    }
+    if(cached_id_mode == CACHED_ID_CPUID) return lapic_initial_id();
+
+    uint32_t aux;
+    __asm__ __volatile__("rdtscp" : "=c"(aux) : : "rax", "rdx");
+    return aux;
+}
+
 void lapic_enable() {
     // set bit 11 in the APIC_BASE MSR to enable the APIC
     uint32_t base = msr_read(MSR_APIC_BASE);
@@ -61,3 +105,12 @@ int lapic_ext_triggered(uint8_t vector) {
 void lapic_conditional_eoi(uint8_t vector) {
     if(lapic_ext_triggered(vector)) lapic_send_eoi();
 }
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+    set_reg(LAPIC_REG_ICR_HIGH, (uint32_t)apic_id << 24);
+    // fixed delivery, physical destination; writing the low half sends it
+    set_reg(LAPIC_REG_ICR_LOW, vector);
+
+    // wait for the delivery status bit to clear
+    while(get_reg(LAPIC_REG_ICR_LOW) & (1<<12)) {}
+}
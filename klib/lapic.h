@@ -7,10 +7,22 @@
 void lapic_setup(void);
 
 uint8_t lapic_id(void);
+// initial APIC ID from CPUID; works without the LAPIC being set up
+uint8_t lapic_initial_id(void);
+// the initial APIC ID, kept in TSC_AUX so that hot paths can read it with
+// RDTSCP instead of a serializing CPUID. lapic_cache_id must be called once
+// on every CPU as it comes up; without RDTSCP, lapic_cached_id falls back
+// to CPUID
+void lapic_cache_id(void);
+int lapic_has_rdtscp(void);
+uint8_t lapic_cached_id(void);
 
 void lapic_send_eoi(void);
 int lapic_ext_triggered(uint8_t vector);
 // helper function
 void lapic_conditional_eoi(uint8_t vector);
 
+// sends a fixed interrupt to the processor with the given APIC ID
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+
 #endif
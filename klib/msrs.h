@@ -3,5 +3,6 @@
 
 #define MSR_APIC_BASE 0x1b
 #define MSR_GS_BASE 0xc0000101
+#define MSR_TSC_AUX 0xc0000103
 
 #endif
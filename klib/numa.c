@@ -0,0 +1,200 @@
+#include "klib/phy.h"
+#include "klib/synch.h"
+
+#include "kmem.h"
+#include "kmem_private.h"
+
+int kmem_numa_add_range(uint64_t base, uint64_t size, uint64_t node) {
+    if(node >= KMEM_MAX_NODES || size == 0) return -1;
+
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    int ret = 1;
+    if(!kmem_state->numa_applied
+        && kmem_state->range_count < KMEM_MAX_NUMA_RANGES) {
+
+        kmem_numa_range_t *range =
+            kmem_state->ranges + kmem_state->range_count;
+        range->base = base;
+        range->end = base + size;
+        range->node = node;
+        kmem_state->range_count ++;
+        ret = 0;
+    }
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+    return ret;
+}
+
+int kmem_numa_set_cpu(uint64_t cpu, uint64_t node) {
+    // CPUs without a magazine always allocate from node 0 anyway
+    if(cpu >= KMEM_MAX_CPUS || node >= KMEM_MAX_NODES) return -1;
+
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    int ret = 1;
+    if(!kmem_state->numa_applied) {
+        kmem_state->cpu_nodes[cpu] = node;
+        ret = 0;
+    }
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+    return ret;
+}
+
+int kmem_numa_set_distance(uint64_t from, uint64_t to, uint64_t distance) {
+    if(from >= KMEM_MAX_NODES || to >= KMEM_MAX_NODES) return -1;
+    if(distance == 0 || distance > 0xff) return -1;
+
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    int ret = 1;
+    if(!kmem_state->numa_applied) {
+        kmem_state->distance[from][to] = distance;
+        ret = 0;
+    }
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+    return ret;
+}
+
+static uint64_t node_distance(uint64_t from, uint64_t to) {
+    uint64_t distance = kmem_state->distance[from][to];
+    if(distance) return distance;
+    return from == to ? KMEM_NUMA_LOCAL : KMEM_NUMA_REMOTE;
+}
+
+// sorts every node's fallback order by distance, nearest first; a node
+// always comes first in its own order, even if firmware says otherwise
+static void sort_fallbacks(void) {
+    for(uint64_t n = 0; n < kmem_state->node_count; n ++) {
+        uint8_t *order = kmem_state->nodes[n].fallback;
+        order[0] = n;
+        uint64_t count = 1;
+        for(uint64_t m = 0; m < kmem_state->node_count; m ++) {
+            if(m == n) continue;
+
+            uint64_t i = count++;
+            while(i > 1 && node_distance(n, order[i-1]) > node_distance(n, m)) {
+                order[i] = order[i-1];
+                i --;
+            }
+            order[i] = m;
+        }
+    }
+}
+
+// the caller must hold the lock
+static void push_page(uint64_t page) {
+    kmem_node_t *node = kmem_state->nodes + kmem_node_of(page);
+    phy_write64(page, node->free_head);
+    node->free_head = page;
+    node->free_count ++;
+}
+
+int kmem_numa_apply(void) {
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    // pages already on the node lists were placed by the applied topology
+    if(kmem_state->numa_applied) {
+        synch_spinunlock(&kmem_state->lock);
+        kmem_irq_restore(flags);
+        return 1;
+    }
+    kmem_state->numa_applied = 1;
+
+    uint64_t count = 1;
+    for(uint64_t i = 0; i < kmem_state->range_count; i ++) {
+        if(kmem_state->ranges[i].node >= count) {
+            count = kmem_state->ranges[i].node + 1;
+        }
+    }
+    for(uint64_t i = 0; i < KMEM_MAX_CPUS; i ++) {
+        if(kmem_state->cpu_nodes[i] >= count) {
+            count = kmem_state->cpu_nodes[i] + 1;
+        }
+    }
+    kmem_state->node_count = count;
+    sort_fallbacks();
+
+    // move every free page onto the list of the node it belongs to; the
+    // lists only hold pages freed since boot, so this walk is short. Pages in
+    // the per-CPU caches find their node when they are drained.
+    uint64_t heads[KMEM_MAX_NODES];
+    for(uint64_t n = 0; n < KMEM_MAX_NODES; n ++) {
+        heads[n] = kmem_state->nodes[n].free_head;
+        kmem_state->nodes[n].free_head = 0;
+        kmem_state->nodes[n].free_count = 0;
+    }
+    for(uint64_t n = 0; n < KMEM_MAX_NODES; n ++) {
+        uint64_t page = heads[n];
+        while(page) {
+            uint64_t next = phy_read64(page);
+            push_page(page);
+            page = next;
+        }
+    }
+
+    // hand the untouched ranges to their nodes, splitting those that span
+    // more than one; split-off parts are appended and handled in turn
+    for(uint64_t i = 0; i < kmem_state->free_range_count; i ++) {
+        kmem_free_range_t *range = kmem_state->free_ranges + i;
+        uint64_t span;
+        range->node = kmem_node_span(range->next, &span);
+
+        if(span < range->end) {
+            if(kmem_state->free_range_count < KMEM_MAX_FREE_RANGES) {
+                kmem_free_range_t *rest =
+                    kmem_state->free_ranges + kmem_state->free_range_count++;
+                rest->next = span;
+                rest->end = range->end;
+            }
+            // out of descriptors: put the rest on the lists
+            else {
+                for(uint64_t p = span; p < range->end; p += 0x1000) {
+                    push_page(p);
+                }
+            }
+            range->end = span;
+        }
+
+        kmem_state->nodes[range->node].free_count +=
+            (range->end - range->next) / 0x1000;
+    }
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+    return 0;
+}
+
+uint64_t kmem_node_of(uint64_t page) {
+    uint64_t end;
+    return kmem_node_span(page, &end);
+}
+
+// returns the node of page, and in end the first address past it that may
+// belong to another node
+uint64_t kmem_node_span(uint64_t page, uint64_t *end) {
+    *end = -1ULL;
+    for(uint64_t i = 0; i < kmem_state->range_count; i ++) {
+        kmem_numa_range_t *range = kmem_state->ranges + i;
+        if(page >= range->base && page < range->end) {
+            *end = range->end;
+            // ranges for nodes not applied yet stay with node 0 until then
+            if(range->node >= kmem_state->node_count) return 0;
+            return range->node;
+        }
+
+        // memory outside every range ends where the next one begins
+        if(range->base > page && range->base < *end) *end = range->base;
+    }
+
+    return 0;
+}
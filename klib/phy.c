@@ -43,3 +43,23 @@ void phy_write64(uint64_t address, uint64_t value) {
 void phy_write(uint64_t address, const void *buffer, uint64_t count) {
     mem_copy(PHY_MAP_BASE + address, buffer, count);
 }
+
+void phy_clear(uint64_t address, uint64_t count) {
+    uint8_t *p = PHY_MAP_BASE + address;
+
+    // whole qwords at a time, then whatever is left
+    uint64_t qwords = count / 8;
+    __asm__ __volatile__("rep stosq"
+        : "+D"(p), "+c"(qwords) : "a"(0ULL) : "memory");
+    mem_set(p, 0, count % 8);
+}
+
+void phy_copy(uint64_t dest, uint64_t src, uint64_t count) {
+    uint8_t *d = PHY_MAP_BASE + dest;
+    const uint8_t *s = PHY_MAP_BASE + src;
+
+    uint64_t qwords = count / 8;
+    __asm__ __volatile__("rep movsq"
+        : "+D"(d), "+S"(s), "+c"(qwords) : : "memory");
+    mem_copy(d, s, count % 8);
+}
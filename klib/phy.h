@@ -13,5 +13,7 @@ void phy_write16(uint64_t address, uint16_t value);
 void phy_write32(uint64_t address, uint32_t value);
 void phy_write64(uint64_t address, uint64_t value);
 void phy_write(uint64_t address, const void *buffer, uint64_t count);
+void phy_clear(uint64_t address, uint64_t count);
+void phy_copy(uint64_t dest, uint64_t src, uint64_t count);
 
 #endif
@@ -28,12 +28,13 @@ task_state_t *task_create() {
     ts->gs = 0x10;
     ts->ss = 0x10;
     ts->rflags = 0x2; // TODO: make this more sensible
+    ts->faults = 0;
 
     return ts;
 }
 
 void task_load_elf(task_state_t *ts, const void *elf_image,
-    uint64_t stack_size) {
+    uint64_t stack_size, uint64_t flags) {
 
     ts->cr3 = kmem_create_root();
 
@@ -44,9 +45,17 @@ void task_load_elf(task_state_t *ts, const void *elf_image,
         stack_bottom -= 0x1000;
         stack_size -= 0x1000;
 
-        uint64_t page = kmem_getpage();
-        kmem_map(ts->cr3, stack_bottom, page, KMEM_MAP_DATA);
+        // only the top of the stack is backed up front; the rest is filled
+        // in by the scheduler as the stack grows into it
+        if((flags & TASK_LOAD_EAGER)
+            || DEFAULT_TASK_STACK_TOP - stack_bottom <= TASK_STACK_COMMIT) {
+
+            kmem_map(ts->cr3, stack_bottom, kmem_getpage(), KMEM_MAP_DATA);
+        }
+        else kmem_map(ts->cr3, stack_bottom, 0, KMEM_MAP_RESERVED);
     }
+    // and overflowing it faults instead of running into whatever is below
+    kmem_map(ts->cr3, stack_bottom - 0x1000, 0, KMEM_PAGE_GUARD);
 
     ts->rsp = DEFAULT_TASK_STACK_TOP;
 
@@ -56,32 +65,49 @@ void task_load_elf(task_state_t *ts, const void *elf_image,
     for(int i = 0; i < header->e_phnum; i ++) {
         if(phdrs[i].p_type != PT_LOAD) continue;
 
-        // ensure everything has backed memory
-        uint64_t start = phdrs[i].p_vaddr & ~0xfff;
-        uint64_t end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+        uint64_t vaddr = phdrs[i].p_vaddr;
+        uint64_t file_end = vaddr + phdrs[i].p_filesz;
+        uint64_t end = vaddr + phdrs[i].p_memsz;
+        const uint8_t *data = (const uint8_t *)elf_image + phdrs[i].p_offset;
 
-        while(start < end) {
-            kmem_map(ts->cr3, start, kmem_getpage(), KMEM_MAP_DATA);
-            start += 0x1000;
-        }
+        // TODO: support regular read-only regions...
+        int writable = (phdrs[i].p_flags & PF_W) && !(phdrs[i].p_flags & PF_X);
+        uint64_t map_flags = writable ? KMEM_MAP_DATA : KMEM_MAP_CODE;
+
+        // read-only pages can be used straight out of the image if it lines
+        // up with the segment's pages
+        int shared = !writable && ((uint64_t)data & 0xfff) == (vaddr & 0xfff);
+
+        for(uint64_t start = vaddr & ~0xfff; start < end; start += 0x1000) {
+            // pages holding nothing but image contents
+            if(shared && start >= vaddr && start + 0x1000 <= file_end) {
+                uint64_t page = kmem_get_phy(kmem_current(),
+                    (uint64_t)data + (start - vaddr));
+                // the image is part of the kernel; it must never be freed
+                kmem_frame_t *frame = kmem_frame(page);
+                if(frame) frame->flags |= KMEM_FRAME_PINNED;
+
+                kmem_map(ts->cr3, start, page, map_flags);
+                continue;
+            }
 
-        kmem_memcpy(ts->cr3, phdrs[i].p_vaddr,
-            (uint8_t *)elf_image + phdrs[i].p_offset,
-            phdrs[i].p_filesz);
-        if(phdrs[i].p_memsz != phdrs[i].p_filesz) {
-            kmem_memclr(ts->cr3, phdrs[i].p_vaddr + phdrs[i].p_filesz,
-                phdrs[i].p_memsz - phdrs[i].p_filesz);
-        }
+            // writable pages past the end of the file are filled on demand
+            if(writable && start >= file_end && !(flags & TASK_LOAD_EAGER)) {
+                kmem_map(ts->cr3, start, 0, KMEM_MAP_RESERVED);
+                continue;
+            }
 
-        // remap executable regions as KMEM_MAP_CODE
-        // TODO: support regular read-only regions...
-        if(phdrs[i].p_flags & PF_X || !(phdrs[i].p_flags & PF_W)) {
-            start = phdrs[i].p_vaddr & ~0xfff;
-            end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
-            while(start < end) {
-                kmem_set_flags(ts->cr3, start, KMEM_MAP_CODE);
-                start += 0x1000;
+            kmem_map(ts->cr3, start, kmem_getpage_zeroed(), KMEM_MAP_DATA);
+
+            // whatever part of the file falls into this page
+            uint64_t from = start > vaddr ? start : vaddr;
+            uint64_t to = start + 0x1000 < file_end ? start + 0x1000 : file_end;
+            if(from < to) {
+                kmem_memcpy(ts->cr3, from, (void *)(data + (from - vaddr)),
+                    to - from);
             }
+
+            if(!writable) kmem_set_flags(ts->cr3, start, map_flags);
         }
     }
 
@@ -8,6 +8,17 @@
 #define NUM_TASKS 4096
 #define TASK_ADDR(i) (TASK_BASE + 0x1000 + (i)*256)
 #define TASK_MEM(i) ((task_state_t *)(TASK_ADDR(i)))
+// per-CPU bitmaps with one bit per PCID, right after the task states;
+// indexed by the CPU number transfer_control reads from TSC_AUX, so there
+// are as many as KMEM_MAX_CPUS
+#define TASK_PCID_CPUS 16
+#define TASK_PCID_BITMAP_SIZE 512
+// set when the PCID must be flushed on the CPU's next load of it
+#define TASK_PCID_FLUSH(cpu) ((uint64_t *)(TASK_BASE + 0x1000 + NUM_TASKS*256 \
+    + (cpu)*TASK_PCID_BITMAP_SIZE))
+// set when the CPU loads the PCID, so it may hold translations tagged with it
+#define TASK_PCID_RUN(cpu) ((uint64_t *)((uint64_t)TASK_PCID_FLUSH(cpu) \
+    + TASK_PCID_CPUS*TASK_PCID_BITMAP_SIZE))
 
 #define TASK_STATE_VALID    0x01
 #define TASK_STATE_RUNNABLE 0x02
@@ -43,7 +54,7 @@ typedef struct task_state_t {
     uint64_t gs_base;       // 25
     uint64_t cr3;           // 26
     uint64_t state;         // 27
-    uint64_t pad1;          // 28
+    uint64_t faults;        // 28
     uint64_t pad2;          // 29
     uint64_t pad3;          // 30
     uint64_t pad4;          // 31
@@ -51,8 +62,13 @@ typedef struct task_state_t {
 
 task_state_t *task_create(void);
 
+// task_load_elf flags
+#define TASK_LOAD_EAGER 0x01 // back everything up front, without page faults
+// stack backed up front otherwise
+#define TASK_STACK_COMMIT 0x4000
+
 void task_load_elf(task_state_t *ts, const void *elf_image,
-    uint64_t stack_size);
+    uint64_t stack_size, uint64_t flags);
 void task_set_local(task_state_t *ts, void *entry, void *stack_top);
 
 void task_mark_runnable(task_state_t *ts);
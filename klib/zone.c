@@ -0,0 +1,152 @@
+#include "klib/phy.h"
+#include "klib/synch.h"
+
+#include "kmem.h"
+#include "kmem_private.h"
+
+#define BLOCK_SIZE(order) (0x1000ULL << (order))
+
+static void list_push(kmem_zone_t *zone, uint64_t block, uint64_t order) {
+    uint64_t head = zone->free_heads[order];
+    phy_write64(block, head);
+    phy_write64(block + 8, 0);
+    if(head) phy_write64(head + 8, block);
+    zone->free_heads[order] = block;
+
+    phy_write8(zone->order_map + (block - zone->base) / 0x1000,
+        KMEM_ZONE_FREE | order);
+}
+
+static void list_remove(kmem_zone_t *zone, uint64_t block, uint64_t order) {
+    uint64_t next = phy_read64(block);
+    uint64_t prev = phy_read64(block + 8);
+    if(prev) phy_write64(prev, next);
+    else zone->free_heads[order] = next;
+    if(next) phy_write64(next + 8, prev);
+
+    phy_write8(zone->order_map + (block - zone->base) / 0x1000, 0);
+}
+
+void kmem_zone_setup(int zone_index, uint64_t base, uint64_t size) {
+    kmem_zone_t *zone = kmem_state->zones + zone_index;
+
+    // zones start 2MB-aligned so that every block is naturally aligned
+    size &= ~(BLOCK_SIZE(KMEM_MAX_ORDER) - 1);
+    if(size > KMEM_ZONE_MAX_SIZE) size = KMEM_ZONE_MAX_SIZE;
+    if(base & (BLOCK_SIZE(KMEM_MAX_ORDER) - 1) || size == 0) return;
+
+    // a single page of order map covers KMEM_ZONE_MAX_SIZE
+    uint64_t map = kmem_getpage();
+    if(!map) return;
+    for(uint64_t i = 0; i < 0x1000; i += 8) phy_write64(map + i, 0);
+
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    zone->base = base;
+    zone->pages = size / 0x1000;
+    zone->order_map = map;
+    zone->free_pages = 0;
+    for(int i = 0; i <= KMEM_MAX_ORDER; i ++) zone->free_heads[i] = 0;
+
+    for(uint64_t b = base; b < base + size; b += BLOCK_SIZE(KMEM_MAX_ORDER)) {
+        list_push(zone, b, KMEM_MAX_ORDER);
+        zone->free_pages += 1ULL << KMEM_MAX_ORDER;
+    }
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+}
+
+kmem_zone_t *kmem_zone_of(uint64_t page) {
+    for(int i = 0; i < KMEM_ZONE_COUNT; i ++) {
+        kmem_zone_t *zone = kmem_state->zones + i;
+        if(page >= zone->base && page < zone->base + zone->pages * 0x1000) {
+            return zone;
+        }
+    }
+    return 0;
+}
+
+uint64_t kmem_zone_alloc(kmem_zone_t *zone, uint64_t order) {
+    // find the smallest free block that is large enough
+    uint64_t k = order;
+    while(k <= KMEM_MAX_ORDER && zone->free_heads[k] == 0) k ++;
+    if(k > KMEM_MAX_ORDER) return 0;
+
+    uint64_t block = zone->free_heads[k];
+    list_remove(zone, block, k);
+
+    // split it down, returning the upper halves to the free lists
+    while(k > order) {
+        k --;
+        list_push(zone, block + BLOCK_SIZE(k), k);
+    }
+
+    zone->free_pages -= 1ULL << order;
+
+    return block;
+}
+
+void kmem_zone_free(kmem_zone_t *zone, uint64_t block, uint64_t order) {
+    zone->free_pages += 1ULL << order;
+
+    // coalesce with free buddies as far up as possible
+    while(order < KMEM_MAX_ORDER) {
+        uint64_t buddy = zone->base + ((block - zone->base) ^ BLOCK_SIZE(order));
+        uint8_t tag = phy_read8(zone->order_map + (buddy - zone->base) / 0x1000);
+        if(tag != (KMEM_ZONE_FREE | order)) break;
+
+        list_remove(zone, buddy, order);
+        if(buddy < block) block = buddy;
+        order ++;
+    }
+
+    list_push(zone, block, order);
+}
+
+uint64_t kmem_order(uint64_t size) {
+    uint64_t order = 0;
+    while(BLOCK_SIZE(order) < size) order ++;
+    return order;
+}
+
+uint64_t kmem_getblock(int zone, uint64_t order) {
+    if(order > KMEM_MAX_RUN_ORDER) return 0;
+
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    uint64_t block = 0;
+    if(order <= KMEM_MAX_ORDER) {
+        block = kmem_zone_alloc(kmem_state->zones + zone, order);
+        // DMA32 memory satisfies a normal request just as well
+        if(!block && zone == KMEM_ZONE_NORMAL) {
+            block = kmem_zone_alloc(kmem_state->zones + KMEM_ZONE_DMA32, order);
+        }
+    }
+    // the zones are small; anything else comes out of the free ranges
+    if(!block) {
+        block = kmem_range_carve(BLOCK_SIZE(order),
+            zone == KMEM_ZONE_DMA32 ? 0x100000000ULL : -1ULL);
+    }
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+
+    return block;
+}
+
+void kmem_unuseblock(uint64_t base, uint64_t order) {
+    uint64_t flags = kmem_irq_save();
+    synch_spinlock(&kmem_state->lock);
+
+    kmem_zone_t *zone = kmem_zone_of(base);
+    if(zone) kmem_zone_free(zone, base, order);
+
+    synch_spinunlock(&kmem_state->lock);
+    kmem_irq_restore(flags);
+
+    // carved out of a free range
+    if(!zone) kmem_unuse_range(base, BLOCK_SIZE(order));
+}
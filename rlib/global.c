@@ -2,13 +2,29 @@
 #include "clib/heap.h"
 
 #include "heap.h"
+#include "scheduler.h"
 
 static void *g_map_start;
 
+// per-thread heap caches hang off task-local storage
+static void *heap_cache_get(void) {
+    void *cache;
+    __asm__ __volatile__("mov %%gs:0x410, %%rax" : "=a"(cache));
+    return cache;
+}
+
+static void heap_cache_set(void *cache) {
+    __asm__ __volatile__("mov %%rax, %%gs:0x410" : : "a"(cache));
+}
+
 void rlib_setup(void *heap_start, void *map_start) {
     g_map_start = map_start;
     heap_init(heap_start);
     heap_set_sizer(heap_rlib_sizer, 0);
+    heap_rlib_publish();
+    // local tasks share the heap, and only run when others yield
+    heap_set_lock_wait(rlib_yield);
+    heap_set_thread_cache(heap_cache_get, heap_cache_set);
 }
 
 void *rlib_map_start() {
@@ -4,20 +4,37 @@
 #include "global.h"
 #include "mman.h"
 
+// shared by every thread of the process, as the heap is
 static int64_t heap_size = 0;
 
+void heap_rlib_publish(void) {
+    __asm__ __volatile__("mov %%rax, %%gs:0x408" : : "a"(&heap_size));
+}
+
 void *heap_rlib_sizer(void __attribute__((unused)) *context, int64_t by) {
-    // currently don't support shrinking
-    if(by < 0) return (uint8_t *)heap_get_start() + heap_size;
+    uint64_t prev_end = (uint64_t)heap_get_start() + heap_size;
 
-    by = (by+0xfff) & ~0xfff;
+    if(by < 0) {
+        // dlmalloc only gives back whole pages off the top
+        uint64_t shrink = (-by) & ~0xfffULL;
+        if(shrink > (uint64_t)heap_size) return (void *)-1;
+        if(shrink == 0) return (void *)prev_end;
 
-    uint64_t new_size = heap_size + by;
-    uint64_t prev_end = (uint64_t)heap_get_start() + heap_size;
-    rlib_anonymous(prev_end, by);
+        if(rlib_unmap(prev_end - shrink, shrink) != 0) return (void *)-1;
+        heap_size -= shrink;
+    }
+    else {
+        by = (by+0xfff) & ~0xfff;
+
+        // only what is touched gets backed; large growth steps get 2MB
+        // pages wherever they line up
+        if(by > 0 && rlib_map_anonymous(prev_end, by,
+            RLIB_MAP_RESERVE | RLIB_MAP_HUGE) == 0) {
 
-    uint64_t old_size = heap_size;
-    heap_size = new_size;
+            return (void *)-1;
+        }
+        heap_size += by;
+    }
 
-    return (uint8_t *)heap_get_start() + old_size;
+    return (void *)prev_end;
 }
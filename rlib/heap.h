@@ -6,5 +6,8 @@
 #include "clib/heap.h"
 
 void *heap_rlib_sizer(void __attribute__((unused)) *context, int64_t by);
+// points the calling thread's task-local storage at the process's heap size,
+// for the scheduler's statistics; done once, by the main thread
+void heap_rlib_publish(void);
 
 #endif
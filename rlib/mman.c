@@ -30,6 +30,10 @@ void rlib_current_memory_space(rlib_memory_space_t *mspace) {
 }
 
 uint64_t rlib_anonymous(uint64_t address, uint64_t size) {
+    return rlib_map_anonymous(address, size, 0);
+}
+
+uint64_t rlib_map_anonymous(uint64_t address, uint64_t size, uint64_t flags) {
     if(address == 0) {
         address = rlib_get_memory_address(size);
     }
@@ -46,6 +50,70 @@ uint64_t rlib_anonymous(uint64_t address, uint64_t size) {
     in.map_anonymous.root_id = 0; // current root
     in.map_anonymous.address = address;
     in.map_anonymous.size = size;
+    in.map_anonymous.flags = 0;
+    if(flags & RLIB_MAP_HUGE) in.map_anonymous.flags |= SCHED_MAP_HUGE;
+    if(flags & RLIB_MAP_RESERVE) in.map_anonymous.flags |= SCHED_MAP_RESERVE;
+    if(flags & RLIB_MAP_GUARD) in.map_anonymous.flags |= SCHED_MAP_GUARD;
+    comm_write(schedin, &in, sizeof(in));
+    __asm__ __volatile__("int $0xfe" : : "a"(own_id));
+
+    sched_out_packet_t out;
+    out.req_id = 0;
+    uint64_t length = sizeof(out);
+    while(comm_read(schedout, &out, &length, 0) || out.req_id != in.req_id) {
+        length = sizeof(out);
+        __asm__ __volatile__("int $0xfe" : : "a"(own_id));
+    }
+
+    if(out.result != 0) return 0;
+    return address;
+}
+
+uint64_t rlib_unmap(uint64_t address, uint64_t size) {
+    uint64_t own_id;
+    comm_t *schedin, *schedout;
+    __asm__ __volatile__("mov %%gs:0x00, %%rax" : "=a"(own_id));
+    __asm__ __volatile__("mov %%gs:0x08, %%rax" : "=a"(schedin));
+    __asm__ __volatile__("mov %%gs:0x10, %%rax" : "=a"(schedout));
+
+    sched_in_packet_t in;
+    in.type = SCHED_UNMAP;
+    in.req_id = rlib_sequence();
+    in.unmap.root_id = 0; // current root
+    in.unmap.address = address;
+    in.unmap.size = size;
+    comm_write(schedin, &in, sizeof(in));
+    __asm__ __volatile__("int $0xfe" : : "a"(own_id));
+
+    sched_out_packet_t out;
+    out.req_id = 0;
+    uint64_t length = sizeof(out);
+    while(comm_read(schedout, &out, &length, 0) || out.req_id != in.req_id) {
+        length = sizeof(out);
+        __asm__ __volatile__("int $0xfe" : : "a"(own_id));
+    }
+
+    return out.result;
+}
+
+// maps physically contiguous memory below 4GB, suitable for device DMA
+uint64_t rlib_map_dma(uint64_t address, uint64_t size, uint64_t *phy) {
+    if(address == 0) {
+        address = rlib_get_memory_address(size);
+    }
+
+    uint64_t own_id;
+    comm_t *schedin, *schedout;
+    __asm__ __volatile__("mov %%gs:0x00, %%rax" : "=a"(own_id));
+    __asm__ __volatile__("mov %%gs:0x08, %%rax" : "=a"(schedin));
+    __asm__ __volatile__("mov %%gs:0x10, %%rax" : "=a"(schedout));
+
+    sched_in_packet_t in;
+    in.type = SCHED_MAP_DMA;
+    in.req_id = rlib_sequence();
+    in.map_dma.root_id = 0; // current root
+    in.map_dma.address = address;
+    in.map_dma.size = size;
     comm_write(schedin, &in, sizeof(in));
     __asm__ __volatile__("int $0xfe" : : "a"(own_id));
 
@@ -57,12 +125,21 @@ uint64_t rlib_anonymous(uint64_t address, uint64_t size) {
         __asm__ __volatile__("int $0xfe" : : "a"(own_id));
     }
 
+    if(out.result != 0) return 0;
+
+    *phy = out.map_dma.phy_addr;
     return address;
 }
 
 void rlib_copy(uint64_t address, rlib_memory_space_t *origin,
     uint64_t oaddress, uint64_t size) {
 
+    rlib_map_mirror(address, origin, oaddress, size, 0);
+}
+
+void rlib_map_mirror(uint64_t address, rlib_memory_space_t *origin,
+    uint64_t oaddress, uint64_t size, uint64_t flags) {
+
     uint64_t own_id;
     comm_t *schedin, *schedout;
     __asm__ __volatile__("mov %%gs:0x00, %%rax" : "=a"(own_id));
@@ -77,11 +154,61 @@ void rlib_copy(uint64_t address, rlib_memory_space_t *origin,
     in.map_mirror.oroot_id = origin->root_id;
     in.map_mirror.oaddress = oaddress;
     in.map_mirror.size = size;
+    in.map_mirror.flags = 0;
+    if(flags & RLIB_MIRROR_COW) in.map_mirror.flags |= SCHED_MIRROR_COW;
     comm_write(schedin, &in, sizeof(in));
 
     sched_out_packet_t out;
-    uint64_t length;
+    out.req_id = 0;
+    uint64_t length = sizeof(out);
     while(comm_read(schedout, &out, &length, 0) || out.req_id != in.req_id) {
+        length = sizeof(out);
         __asm__ __volatile__("int $0xfe" : : "a"(own_id));
     }
 }
+
+static uint64_t rlib_set_numa(uint64_t kind, uint64_t a, uint64_t b,
+    uint64_t c) {
+
+    uint64_t own_id;
+    comm_t *schedin, *schedout;
+    __asm__ __volatile__("mov %%gs:0x00, %%rax" : "=a"(own_id));
+    __asm__ __volatile__("mov %%gs:0x08, %%rax" : "=a"(schedin));
+    __asm__ __volatile__("mov %%gs:0x10, %%rax" : "=a"(schedout));
+
+    sched_in_packet_t in;
+    in.type = SCHED_SET_NUMA;
+    in.req_id = rlib_sequence();
+    in.set_numa.kind = kind;
+    in.set_numa.a = a;
+    in.set_numa.b = b;
+    in.set_numa.c = c;
+    comm_write(schedin, &in, sizeof(in));
+    __asm__ __volatile__("int $0xfe" : : "a"(own_id));
+
+    sched_out_packet_t out;
+    out.req_id = 0;
+    uint64_t length = sizeof(out);
+    while(comm_read(schedout, &out, &length, 0) || out.req_id != in.req_id) {
+        length = sizeof(out);
+        __asm__ __volatile__("int $0xfe" : : "a"(own_id));
+    }
+
+    return out.result;
+}
+
+uint64_t rlib_numa_range(uint64_t base, uint64_t size, uint64_t node) {
+    return rlib_set_numa(SCHED_NUMA_RANGE, base, size, node);
+}
+
+uint64_t rlib_numa_cpu(uint64_t apic_id, uint64_t node) {
+    return rlib_set_numa(SCHED_NUMA_CPU, apic_id, node, 0);
+}
+
+uint64_t rlib_numa_distance(uint64_t from, uint64_t to, uint64_t distance) {
+    return rlib_set_numa(SCHED_NUMA_DISTANCE, from, to, distance);
+}
+
+void rlib_numa_apply(void) {
+    rlib_set_numa(SCHED_NUMA_APPLY, 0, 0, 0);
+}
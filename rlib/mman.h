@@ -5,15 +5,35 @@
 
 #define RLIB_ADDRESS_DONTCARE ((uint64_t)0)
 
+// rlib_map_anonymous flags
+#define RLIB_MAP_HUGE 0x01 // use 2MB pages where alignment allows
+#define RLIB_MAP_RESERVE 0x02 // only back pages once they are touched
+#define RLIB_MAP_GUARD 0x04 // leave the lowest page as a guard page
+
+// rlib_map_mirror flags
+#define RLIB_MIRROR_COW 0x01 // private copy, shared until written to
+
 typedef struct rlib_memory_space_t rlib_memory_space_t;
 
 void rlib_current_memory_space(rlib_memory_space_t *mspace);
 uint64_t rlib_anonymous(uint64_t address, uint64_t size);
+uint64_t rlib_map_anonymous(uint64_t address, uint64_t size, uint64_t flags);
+uint64_t rlib_map_dma(uint64_t address, uint64_t size, uint64_t *phy);
+uint64_t rlib_unmap(uint64_t address, uint64_t size);
 void rlib_anonymous_remote(rlib_memory_space_t *mspace, uint64_t address,
     uint64_t size);
 void rlib_copy(uint64_t address, rlib_memory_space_t *origin,
     uint64_t oaddress, uint64_t size);
+void rlib_map_mirror(uint64_t address, rlib_memory_space_t *origin,
+    uint64_t oaddress, uint64_t size, uint64_t flags);
 void rlib_copy_remote(rlib_memory_space_t *mspace, uint64_t address,
     uint64_t size, rlib_memory_space_t *origin, uint64_t oaddress);
 
+// NUMA topology, reported once by the hw task; nodes are numbered densely
+// from zero. Allocation only follows it after rlib_numa_apply().
+uint64_t rlib_numa_range(uint64_t base, uint64_t size, uint64_t node);
+uint64_t rlib_numa_cpu(uint64_t apic_id, uint64_t node);
+uint64_t rlib_numa_distance(uint64_t from, uint64_t to, uint64_t distance);
+void rlib_numa_apply(void);
+
 #endif
@@ -1,3 +1,5 @@
+#include "clib/heap.h"
+
 #include "klib/task.h"
 
 #include "kernel/scheduler/interface.h"
@@ -45,6 +47,8 @@ void rlib_create_task(rlib_memory_space_t *memspace, rlib_task_t *task) {
 static void rlib_local_task_wrapper(void (*function)(void *), void *context) {
     function(context);
 
+    // give cached heap blocks back before the task goes away
+    heap_thread_exit();
     rlib_reap_self();
 }
 
@@ -75,7 +79,9 @@ void rlib_set_local_task(rlib_task_t *task, void (*function)(void *),
     in.req_id = rlib_sequence();
     in.set_state.index = SCHED_STATE_RSP;
     stack_size = (stack_size + 0xfff) & ~0xfff;
-    in.set_state.value = rlib_anonymous(0, stack_size) + stack_size;
+    // the stack grows on demand, with a guard page below it
+    in.set_state.value = rlib_map_anonymous(0, stack_size + 0x1000,
+        RLIB_MAP_RESERVE | RLIB_MAP_GUARD) + 0x1000 + stack_size;
     comm_write(schedin, &in, sizeof(in));
 
     rlib_process_queued();